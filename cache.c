@@ -2,34 +2,271 @@
 /*
  * Andrew Id: enhanc
  * cache.c contains helper functions to manipulate cache. The cache is
- * implemented with a doubly linked list. Each entry contains url, 
- * web_object, block_size (size of web_object), prev and next ptr. The
- * size of web_object cannot exceed MAX_OBJECT_SIZE and the total web_object
- * in the list cannot exceed MAX_CACHE_SIZE. Every time a entry is referenced, 
- * it is moved to the front of the list. When the cache does not have enough
- * free space to hold a new entry, LRU data at the end of the list is evicted.
+ * split into CACHE_SHARDS independently locked shards, selected by a
+ * hash of the url. Each shard has its own mutex, hash bucket chains for
+ * O(1) lookup, a doubly linked list for LRU ordering and its own slice
+ * of the total size budget, so operations on different shards proceed
+ * in parallel and threads no longer convoy on one global lock. Each
+ * entry contains url, web_object, block_size (size of web_object),
+ * prev/next ptr for the LRU list and hnext ptr for its hash bucket
+ * chain. The size of web_object cannot exceed the configured max object
+ * size and the total web_object per shard cannot exceed its share of
+ * the configured capacity; both are set at init_cache time.
+ * Every time a entry is referenced, it is moved to the front of its
+ * shard's list; the move only contends with threads hitting the same
+ * shard. When a shard does not have enough free space to hold a new
+ * entry, LRU data at the end of its list is evicted. Entries are
+ * reference counted: a lookup pins the entry so it can be served to the
+ * client outside the shard lock, and eviction defers the free of a
+ * pinned entry to its last release.
  */
 
 #include "csapp.h"
 #include "cache.h"
+#include "slab.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Defaults when the caller passes no geometry; match the original
+// compile-time constants
+#define DEFAULT_MAX_CACHE_SIZE (1024*1024)
+#define DEFAULT_MAX_OBJECT_SIZE (100*1024)
+
+// Number of independently locked shards; power of two so the hash can
+// be masked. A shard's slice of the budget must still fit a
+// max_object_size object; init_cache enforces this.
+#define CACHE_SHARDS 8
+
+// Bounds for the per-shard hash bucket count, which is sized from the
+// configured capacity so chains stay short when the cache holds
+// hundreds of thousands of entries
+#define SHARD_BUCKETS_MIN 64
+#define SHARD_BUCKETS_MAX (1 << 20)
+
+// Snapshot file that makes the cache survive a restart. Written
+// atomically (temp file plus rename) on shutdown and every
+// SNAPSHOT_INTERVAL_SECS, and mapped back in at init so a redeploy
+// starts warm instead of refilling from the origin.
+#define SNAPSHOT_PATH "proxy.cachesnap"
+#define SNAPSHOT_TMP "proxy.cachesnap.tmp"
+#define SNAPSHOT_INTERVAL_SECS 60
 
-#define MAX_CACHE_SIZE (1024*1024)
-#define MAX_OBJECT_SIZE (100*1024)
+/*
+ * One independently locked slice of the cache
+ */
+typedef struct {
+    pthread_mutex_t mutex;          /* protects all fields of this shard */
+    Cache *lru_head;                /* most recently used entry */
+    Cache *lru_tail;                /* least recently used entry */
+    ssize_t size;                   /* bytes cached in this shard */
+    Cache **buckets;                /* hash index of this shard's entries */
+} cache_shard_t;
+
+static cache_shard_t shards[CACHE_SHARDS];
+
+// Cache geometry, fixed at init_cache time
+static ssize_t max_cache_size = DEFAULT_MAX_CACHE_SIZE;
+static ssize_t max_object_size = DEFAULT_MAX_OBJECT_SIZE;
+static unsigned int shard_buckets = SHARD_BUCKETS_MIN;
+
+// Mapping of the snapshot loaded at init; entries restored from it
+// point their web_object into this region, so it stays mapped until
+// release_cache
+static char *snap_map = NULL;
+static size_t snap_map_size = 0;
+
+// Lifecycle of the periodic snapshot thread: snapshot_run is flipped
+// and snapshot_stop signaled under snapshot_mutex, and release_cache
+// joins the thread so no save can run against torn-down shards
+static int snapshot_run = 0;
+static pthread_t snapshot_tid;
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_stop = PTHREAD_COND_INITIALIZER;
+
+/*
+ * On-disk layout of a snapshot: a header, then one record per entry in
+ * LRU-to-MRU order. Each record is the fixed part below, the
+ * NUL-terminated url, then (16-byte aligned) a stamped slab buffer
+ * header followed by the object bytes, so a loaded entry's web_object
+ * can point straight into the mapping and still be handed to
+ * slab_buf_free like any other buffer.
+ */
+typedef struct {
+    char magic[8];      /* format tag and version */
+    long count;         /* records that follow */
+} snap_hdr_t;
+
+typedef struct {
+    long url_len;       /* url bytes including the NUL */
+    long block_size;    /* object bytes */
+    long expires;       /* absolute expiry time, or 0 */
+} snap_rec_t;
+
+static const char snap_magic[8] = "PXYSNAP1";
+
+/*
+ * Hash an url (djb2). High bits select the shard, low bits select the
+ * bucket within the shard, so the two indexes stay independent.
+ *
+ * url: key to be hashed
+ */
+static unsigned int hash_url(char *url) {
+    unsigned int h = 5381;
+    char c;
+    while ((c = *url++) != '\0') {
+        h = h * 33 + (unsigned char) c;
+    }
+    return h;
+}
+
+static cache_shard_t *shard_for(unsigned int h) {
+    return &shards[(h >> 16) & (CACHE_SHARDS - 1)];
+}
+
+/*
+ * Second, independent url hash (sdbm) for the frequency sketch's
+ * double hashing
+ */
+static unsigned int hash2_url(char *url) {
+    unsigned int h = 0;
+    char c;
+    while ((c = *url++) != '\0') {
+        h = (unsigned char) c + (h << 6) + (h << 16) - h;
+    }
+    return h;
+}
+
+/*
+ * Count-min sketch tracking recent url popularity for admission
+ * (TinyLFU). Every lookup bumps the url's counters; when an insert
+ * would evict, the newcomer is admitted only if its estimated
+ * frequency beats the eviction candidate's, so a crawler sweeping
+ * thousands of one-hit urls cannot flush the hot set. Counters are
+ * halved after every CM_SAMPLE_PERIOD lookups so popularity decays and
+ * the sketch tracks the recent workload, not all of history. Counter
+ * updates use relaxed atomics: the sketch is approximate by design, so
+ * a lost increment is cheaper than a lock on every lookup.
+ */
+#define CM_ROWS 4
+#define CM_WIDTH 16384
+#define CM_SAMPLE_PERIOD (CM_WIDTH * 8)
+
+static unsigned char cm_sketch[CM_ROWS][CM_WIDTH];
+static long cm_ops;
+
+/*
+ * Record one access to an url in the sketch
+ */
+static void cm_add(char *url) {
+    unsigned int h1 = hash_url(url);
+    unsigned int h2 = hash2_url(url);
+
+    for (int row = 0; row < CM_ROWS; row++) {
+        unsigned int idx = (h1 + row * h2) & (CM_WIDTH - 1);
+        unsigned char c =
+            __atomic_load_n(&cm_sketch[row][idx], __ATOMIC_RELAXED);
+        if (c < 255) {
+            __atomic_fetch_add(&cm_sketch[row][idx], 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    // Exactly one thread observes the period boundary and ages the
+    // sketch; increments racing with the halving only blur an already
+    // approximate estimate
+    long ops = __atomic_add_fetch(&cm_ops, 1, __ATOMIC_RELAXED);
+    if (ops == CM_SAMPLE_PERIOD) {
+        __atomic_store_n(&cm_ops, 0, __ATOMIC_RELAXED);
+        for (int row = 0; row < CM_ROWS; row++) {
+            for (int i = 0; i < CM_WIDTH; i++) {
+                unsigned char c =
+                    __atomic_load_n(&cm_sketch[row][i], __ATOMIC_RELAXED);
+                __atomic_store_n(&cm_sketch[row][i], c >> 1,
+                                 __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return;
+}
+
+/*
+ * Estimated access frequency of an url: the minimum over the sketch
+ * rows, which bounds the overcount from hash collisions
+ */
+static unsigned int cm_estimate(char *url) {
+    unsigned int h1 = hash_url(url);
+    unsigned int h2 = hash2_url(url);
+    unsigned int min = 255;
+
+    for (int row = 0; row < CM_ROWS; row++) {
+        unsigned int idx = (h1 + row * h2) & (CM_WIDTH - 1);
+        unsigned char c =
+            __atomic_load_n(&cm_sketch[row][idx], __ATOMIC_RELAXED);
+        if (c < min) {
+            min = c;
+        }
+    }
+    return min;
+}
+
+static unsigned int bucket_for(unsigned int h) {
+    return h & (shard_buckets - 1);
+}
+
+/*
+ * Insert an entry into its hash bucket chain. Caller holds the shard
+ * mutex.
+ *
+ * shard: shard that owns the entry
+ * entry: entry to be indexed
+ */
+static void bucket_insert(cache_shard_t *shard, Cache *entry) {
+    unsigned int b = bucket_for(hash_url(entry->url));
+    entry->hnext = shard->buckets[b];
+    shard->buckets[b] = entry;
+    return;
+}
 
 /*
- * Move an entry to the front of the cache.
- * 
+ * Remove an entry from its hash bucket chain. Caller holds the shard
+ * mutex.
+ *
+ * shard: shard that owns the entry
+ * entry: entry to be unindexed
+ */
+static void bucket_remove(cache_shard_t *shard, Cache *entry) {
+    unsigned int b = bucket_for(hash_url(entry->url));
+    Cache **cur = &shard->buckets[b];
+    while (*cur != NULL) {
+        if (*cur == entry) {
+            *cur = entry->hnext;
+            entry->hnext = NULL;
+            return;
+        }
+        cur = &(*cur)->hnext;
+    }
+    return;
+}
+
+/*
+ * Move an entry to the front of its shard's LRU list. Caller holds the
+ * shard mutex.
+ *
+ * shard: shard that owns the entry
  * entry: entry to be moved
  */
-static void move_to_head(Cache *entry) {
+static void move_to_head(cache_shard_t *shard, Cache *entry) {
 
     //entry at theh head already, do nothing
-    if (entry == cache) {
+    if (entry == shard->lru_head) {
         return;
     }
 
@@ -41,159 +278,679 @@ static void move_to_head(Cache *entry) {
         p->next = entry->next;
         n->prev = entry->prev;
 
-        cache->prev = entry;
-        entry->next = cache;
+        shard->lru_head->prev = entry;
+        entry->next = shard->lru_head;
         entry->prev = NULL;
-        cache = entry;
+        shard->lru_head = entry;
     }
 
     //entry at the back
     if (entry->next == NULL && entry->prev != NULL) {
         entry->prev->next = NULL;
+        shard->lru_tail = entry->prev;
 
-        cache->prev = entry;
-        entry->next = cache;
+        shard->lru_head->prev = entry;
+        entry->next = shard->lru_head;
         entry->prev = NULL;
-        cache = entry;
+        shard->lru_head = entry;
     }
 
     return;
 }
 
 /*
- * Remove entries from cache until enough spaces are freed
- * 
- * space: the amount of space that need to be freed
+ * Unlink an entry from its shard's LRU list, wherever it sits. Caller
+ * holds the shard mutex.
+ *
+ * shard: shard that owns the entry
+ * entry: entry to be unlinked
  */
-static void evict_entries(ssize_t space) {
-    
-    Cache *e = cache;
-    ssize_t freed = 0;
-
-    // Go to the end of list where LRU data locate
-    while (e->next != NULL) {
-        e = e->next;
+static void lru_unlink(cache_shard_t *shard, Cache *entry) {
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        shard->lru_head = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        shard->lru_tail = entry->prev;
     }
+    entry->prev = NULL;
+    entry->next = NULL;
+    return;
+}
 
-    // Free entries from the back until enough space
-    // shows up
-    do {
-        Cache *tmp;
+/*
+ * Remove entries from a shard until enough spaces are freed. Caller
+ * holds the shard mutex.
+ *
+ * shard: shard to evict from
+ * space: the amount of space that need to be freed
+ */
+static void evict_entries(cache_shard_t *shard, ssize_t space) {
+
+    ssize_t freed = 0;
 
-        freed += e->block_size;
-        e->prev->next = NULL;
-        
-        tmp = e;
-        e = e->prev;
-        
-        free(tmp->web_object);
-        free(tmp->url);
-        free(tmp);
+    // Unlink entries from the tail pointer until enough space shows up
+    // or the shard is empty; no list walk is needed to find the victim.
+    // An entry still being served (refcount > 0) is unlinked but its
+    // memory is freed by the last release_web_object instead, so a
+    // slow client write can never read a freed buffer.
+    while (freed < space && shard->lru_tail != NULL) {
+        Cache *tmp = shard->lru_tail;
+
+        shard->lru_tail = tmp->prev;
+        if (shard->lru_tail != NULL) {
+            shard->lru_tail->next = NULL;
+        } else {
+            shard->lru_head = NULL;
+        }
 
-    } while (freed < space);
+        freed += tmp->block_size;
+        stats_count_eviction();
+
+        bucket_remove(shard, tmp);
+        if (tmp->refcount == 0) {
+            slab_buf_free(tmp->web_object);
+            free(tmp->url);
+            slab_entry_free(tmp);
+        } else {
+            tmp->evicted = 1;
+            tmp->prev = NULL;
+            tmp->next = NULL;
+        }
+    }
 
-    // update cache size
-    cache_size -= freed;
+    // update shard size
+    shard->size -= freed;
 
     return;
 }
 
 /*
- * See if an url has been stored in the cache. Return the cache entry
- * if match is found. Else return NULL.
- * 
+ * See if an url has been stored in the cache. Only the owning shard is
+ * locked and only its matching bucket chain is searched, so lookups on
+ * different shards run fully in parallel. A hit takes a reference on
+ * the entry, which pins its buffers while the caller writes them to the
+ * client outside the lock; the caller must hand the entry back with
+ * release_web_object when done. Return the cache entry if match is
+ * found. Else return NULL.
+ *
  * request_url: test if this url exists in cache
  */
 Cache *get_web_object(char *request_url) {
-    Cache *cur = cache;
+    unsigned int h = hash_url(request_url);
+    cache_shard_t *shard = shard_for(h);
+    Cache *cur;
+
+    // Every lookup, hit or miss, feeds the admission sketch
+    cm_add(request_url);
+
+    pthread_mutex_lock(&shard->mutex);
+    cur = shard->buckets[bucket_for(h)];
     while (cur != NULL) {
         if (strcmp(request_url, cur->url) == 0) {
-            // Update LRU count 
-            move_to_head(cur);
+            // An entry past its expiry reports a miss but stays in
+            // place, so the refetch can revalidate against it and a
+            // 304 can renew it instead of re-downloading the body. The
+            // entry is replaced (or renewed) by the fetch that follows,
+            // or eventually evicted by LRU pressure.
+            if (cur->expires != 0 && time(NULL) >= cur->expires) {
+                break;
+            }
+
+            // Update LRU count
+            move_to_head(shard, cur);
+            cur->refcount++;
+            pthread_mutex_unlock(&shard->mutex);
+            stats_count_hit();
             return cur;
         }
 
-        cur = cur->next;
+        cur = cur->hnext;
     }
+    pthread_mutex_unlock(&shard->mutex);
+    stats_count_miss();
     return NULL;
 }
 
 /*
- * Add a new entry into cache. Remove LRU cached data before inserting
- * new data if there are not enough free space in cache. 
- * 
- * url: key of the entry
- * web_object: data to be stored 
+ * Look an url up without regard to freshness, so the caller can pull
+ * validators out of an expired copy and, on a 304, serve it as-is. The
+ * entry is pinned exactly like a get_web_object hit and must be handed
+ * back with release_web_object. No hit/miss is counted; the fresh
+ * lookup that preceded this call already did. Returns NULL only if the
+ * url is not cached at all.
+ *
+ * request_url: url to look up, fresh or stale
+ */
+Cache *get_web_object_stale(char *request_url) {
+    unsigned int h = hash_url(request_url);
+    cache_shard_t *shard = shard_for(h);
+    Cache *cur;
+
+    pthread_mutex_lock(&shard->mutex);
+    cur = shard->buckets[bucket_for(h)];
+    while (cur != NULL) {
+        if (strcmp(request_url, cur->url) == 0) {
+            move_to_head(shard, cur);
+            cur->refcount++;
+            pthread_mutex_unlock(&shard->mutex);
+            return cur;
+        }
+
+        cur = cur->hnext;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return NULL;
+}
+
+/*
+ * Renew an entry's freshness after the origin confirmed it unchanged
+ * (304), without touching its body
+ *
+ * url: key of the entry to renew
+ * ttl_secs: seconds of freshness granted, or 0 for no expiry
+ */
+void cache_refresh(char *url, int ttl_secs) {
+    unsigned int h = hash_url(url);
+    cache_shard_t *shard = shard_for(h);
+    Cache *cur;
+
+    pthread_mutex_lock(&shard->mutex);
+    for (cur = shard->buckets[bucket_for(h)]; cur != NULL; cur = cur->hnext) {
+        if (strcmp(url, cur->url) == 0) {
+            cur->expires = ttl_secs > 0 ? time(NULL) + ttl_secs : 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return;
+}
+
+/*
+ * Drop the reference taken by get_web_object. If the entry was evicted
+ * while it was being served, the last reference performs the deferred
+ * free.
+ *
+ * entry: entry returned by a successful get_web_object
+ */
+void release_web_object(Cache *entry) {
+    cache_shard_t *shard = shard_for(hash_url(entry->url));
+
+    pthread_mutex_lock(&shard->mutex);
+    entry->refcount--;
+    if (entry->refcount == 0 && entry->evicted) {
+        pthread_mutex_unlock(&shard->mutex);
+        slab_buf_free(entry->web_object);
+        free(entry->url);
+        slab_entry_free(entry);
+        return;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return;
+}
+
+/*
+ * Add a new entry into cache. The owning shard is locked for the
+ * duration of the insert. Remove LRU cached data from the shard before
+ * inserting new data if there are not enough free space in its slice of
+ * the budget. The cache takes ownership of the heap-allocated
+ * web_object buffer: it is freed here if the entry is rejected, or
+ * later when the entry is evicted, so callers never copy the data a
+ * second time.
+ *
+ * An entry written with a positive ttl_secs expires that many seconds
+ * from now and is dropped by the first lookup past the deadline; this
+ * carries the short-lived negative entries for origin errors. A ttl of
+ * 0 means the entry lives until evicted.
+ *
+ * url: key of the entry (copied)
+ * web_object: heap buffer holding the data; ownership transfers here
  * block_size: size of the data
+ * ttl_secs: seconds until the entry expires, or 0 for no expiry
  */
-void write_cache(char *url, char *web_object, ssize_t block_size) {
-    
-    // check the same url has not been added by other thread
-    if (get_web_object(url) != NULL) {
+void write_cache_ttl(char *url, char *web_object, ssize_t block_size,
+                     int ttl_secs) {
+
+    unsigned int h = hash_url(url);
+    cache_shard_t *shard = shard_for(h);
+    Cache *cur;
+
+    pthread_mutex_lock(&shard->mutex);
+
+    // check the same url has not been added by other thread; an
+    // expired copy left behind for revalidation is replaced instead
+    for (cur = shard->buckets[bucket_for(h)]; cur != NULL; cur = cur->hnext) {
+        if (strcmp(url, cur->url) == 0) {
+            if (cur->expires == 0 || time(NULL) < cur->expires) {
+                pthread_mutex_unlock(&shard->mutex);
+                slab_buf_free(web_object);
+                return;
+            }
+
+            lru_unlink(shard, cur);
+            bucket_remove(shard, cur);
+            shard->size -= cur->block_size;
+            if (cur->refcount == 0) {
+                slab_buf_free(cur->web_object);
+                free(cur->url);
+                slab_entry_free(cur);
+            } else {
+                cur->evicted = 1;
+            }
+            break;
+        }
+    }
+
+    // Objects bigger than a whole shard can never fit
+    if (block_size > max_cache_size / CACHE_SHARDS) {
+        pthread_mutex_unlock(&shard->mutex);
+        slab_buf_free(web_object);
+        return;
+    }
+
+    // Admission (TinyLFU): when inserting means evicting, the
+    // newcomer must be more popular than the entry evict_entries would
+    // remove first; otherwise it is turned away and the hot set stays
+    // put
+    if (shard->size + block_size > max_cache_size / CACHE_SHARDS &&
+        shard->lru_tail != NULL &&
+        cm_estimate(url) <= cm_estimate(shard->lru_tail->url)) {
+        pthread_mutex_unlock(&shard->mutex);
+        slab_buf_free(web_object);
         return;
     }
 
     // Remove LRU entries if new data cannot fit in
-    if (cache_size + block_size > MAX_CACHE_SIZE) {
-        evict_entries(block_size);
+    // the shard's slice of the budget
+    if (shard->size + block_size > max_cache_size / CACHE_SHARDS) {
+        evict_entries(shard, block_size);
     }
 
-    cache_size += block_size;
+    shard->size += block_size;
 
-    // Allocate memory
-    Cache *entry = (Cache *) malloc(sizeof(Cache));
-    entry->url = (char *) malloc(sizeof(char) * MAXLINE);
-    entry->web_object = (char *) malloc(sizeof(char) * block_size);
+    // Take the entry struct from the slab pool; the data buffer is
+    // adopted as-is and the url copy is sized to fit exactly
+    Cache *entry = (Cache *) slab_entry_alloc();
+    entry->url = (char *) malloc(strlen(url) + 1);
 
     // Fill in key and value
     strcpy(entry->url, url);
-    entry->web_object = (char *) memcpy(entry->web_object, web_object,block_size);
+    entry->web_object = web_object;
     entry->block_size = block_size;
     entry->next = NULL;
     entry->prev = NULL;
+    entry->refcount = 0;
+    entry->evicted = 0;
+    entry->expires = ttl_secs > 0 ? time(NULL) + ttl_secs : 0;
+
+    bucket_insert(shard, entry);
 
     //insert empty list
-    if (cache == NULL) {
-        cache = entry;
+    if (shard->lru_head == NULL) {
+        shard->lru_head = entry;
+        shard->lru_tail = entry;
+        pthread_mutex_unlock(&shard->mutex);
         return;
     }
 
     //insert at head
-    cache->prev = entry;
-    entry->next = cache;
+    shard->lru_head->prev = entry;
+    entry->next = shard->lru_head;
     entry->prev = NULL;
-    cache = entry;
+    shard->lru_head = entry;
+    pthread_mutex_unlock(&shard->mutex);
+    return;
+}
+
+/*
+ * Add a new entry that lives until evicted; see write_cache_ttl
+ *
+ * url: key of the entry (copied)
+ * web_object: heap buffer holding the data; ownership transfers here
+ * block_size: size of the data
+ */
+void write_cache(char *url, char *web_object, ssize_t block_size) {
+    write_cache_ttl(url, web_object, block_size, 0);
     return;
 }
 
 /*
- * Initialize cache and cache size
+ * Pad the snapshot file out to the next 16-byte boundary so the slab
+ * buffer header that follows is aligned. Returns the new offset, -1 on
+ * a write error.
+ *
+ * fd: snapshot file being written
+ * off: current file offset
+ */
+static ssize_t snap_pad16(int fd, ssize_t off) {
+    static const char zeros[16];
+    ssize_t pad = (16 - (off & 15)) & 15;
+
+    if (pad > 0 && write(fd, zeros, pad) != pad) {
+        return -1;
+    }
+    return off + pad;
+}
+
+/*
+ * Write the whole entry set to the snapshot file. Each shard is walked
+ * tail-to-head under its lock, so records land in LRU-to-MRU order and
+ * the loader can rebuild the lists by inserting at the head. The file
+ * is built under a temp name and renamed into place only when complete,
+ * so a crash mid-write never clobbers the last good snapshot. Public so
+ * shutdown paths outside this module can snapshot without tearing the
+ * cache down.
  */
-void init_cache() {
-    cache = NULL;
-    cache_size = 0;
+void cache_snapshot_save() {
+    snap_hdr_t hdr;
+    long count = 0;
+    ssize_t off;
+    int ok = 1;
+    int fd = open(SNAPSHOT_TMP, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+
+    if (fd < 0) {
+        return;
+    }
+
+    // Header goes out with a zero count and is patched at the end, so
+    // a torn file is recognizably incomplete
+    memcpy(hdr.magic, snap_magic, 8);
+    hdr.count = 0;
+    if (write(fd, &hdr, sizeof(hdr)) != (ssize_t) sizeof(hdr)) {
+        close(fd);
+        unlink(SNAPSHOT_TMP);
+        return;
+    }
+    off = sizeof(hdr);
+
+    for (int i = 0; ok && i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &shards[i];
+
+        pthread_mutex_lock(&shard->mutex);
+        for (Cache *cur = shard->lru_tail; cur != NULL; cur = cur->prev) {
+            snap_rec_t rec;
+            char bufhdr[64];
+
+            rec.url_len = (long) strlen(cur->url) + 1;
+            rec.block_size = cur->block_size;
+            rec.expires = (long) cur->expires;
+            slab_buf_stamp_mapped(bufhdr);
+
+            if (write(fd, &rec, sizeof(rec)) != (ssize_t) sizeof(rec) ||
+                write(fd, cur->url, rec.url_len) != rec.url_len) {
+                ok = 0;
+                break;
+            }
+            off += sizeof(rec) + rec.url_len;
+
+            if ((off = snap_pad16(fd, off)) < 0) {
+                ok = 0;
+                break;
+            }
+
+            if (write(fd, bufhdr, slab_buf_hdr_size())
+                    != slab_buf_hdr_size() ||
+                write(fd, cur->web_object, cur->block_size)
+                    != cur->block_size) {
+                ok = 0;
+                break;
+            }
+            off += slab_buf_hdr_size() + cur->block_size;
+
+            if ((off = snap_pad16(fd, off)) < 0) {
+                ok = 0;
+                break;
+            }
+            count++;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+
+    if (ok) {
+        hdr.count = count;
+        ok = pwrite(fd, &hdr, sizeof(hdr), 0) == (ssize_t) sizeof(hdr);
+    }
+    if (ok) {
+        fsync(fd);
+        close(fd);
+        rename(SNAPSHOT_TMP, SNAPSHOT_PATH);
+    } else {
+        close(fd);
+        unlink(SNAPSHOT_TMP);
+    }
     return;
 }
 
 /*
- * Free any allocated blocks in the cache
+ * Map the snapshot left by the previous run and rebuild the entry set
+ * from it. The mapping is read-only and pages fault in lazily, so
+ * startup cost is one pass over the index records, not a copy of every
+ * object; web_object pointers go straight into the mapping. Runs before
+ * any worker thread exists, so no locks are taken. Every offset is
+ * bounds-checked and loading simply stops at the first inconsistent
+ * record, leaving a cold (or partially warm) cache rather than a crash.
+ */
+static void cache_snapshot_load() {
+    struct stat st;
+    int fd = open(SNAPSHOT_PATH, O_RDONLY);
+
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(snap_hdr_t)) {
+        close(fd);
+        return;
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    snap_hdr_t *hdr = (snap_hdr_t *) map;
+    if (memcmp(hdr->magic, snap_magic, 8) != 0 || hdr->count < 0) {
+        munmap(map, st.st_size);
+        return;
+    }
+
+    size_t size = (size_t) st.st_size;
+    size_t off = sizeof(snap_hdr_t);
+
+    for (long r = 0; r < hdr->count; r++) {
+        if (off + sizeof(snap_rec_t) > size) {
+            break;
+        }
+        snap_rec_t *rec = (snap_rec_t *) (map + off);
+        off += sizeof(snap_rec_t);
+
+        if (rec->url_len <= 0 || rec->block_size <= 0 ||
+            off + (size_t) rec->url_len > size) {
+            break;
+        }
+        char *url = map + off;
+        if (url[rec->url_len - 1] != '\0') {
+            break;
+        }
+        off += rec->url_len;
+        off = (off + 15) & ~((size_t) 15);
+
+        if (off + slab_buf_hdr_size() + rec->block_size > size) {
+            break;
+        }
+        char *obj = map + off + slab_buf_hdr_size();
+        off += slab_buf_hdr_size() + rec->block_size;
+        off = (off + 15) & ~((size_t) 15);
+
+        // The geometry may have shrunk since the snapshot was taken;
+        // entries that no longer fit are simply skipped
+        unsigned int h = hash_url(url);
+        cache_shard_t *shard = shard_for(h);
+        if (rec->block_size > max_object_size ||
+            shard->size + rec->block_size > max_cache_size / CACHE_SHARDS) {
+            continue;
+        }
+
+        Cache *entry = (Cache *) slab_entry_alloc();
+        entry->url = (char *) malloc(rec->url_len);
+        memcpy(entry->url, url, rec->url_len);
+        entry->web_object = obj;
+        entry->block_size = rec->block_size;
+        entry->refcount = 0;
+        entry->evicted = 0;
+        entry->expires = (time_t) rec->expires;
+
+        bucket_insert(shard, entry);
+
+        // Records run LRU to MRU, so head insertion recreates the order
+        entry->prev = NULL;
+        entry->next = shard->lru_head;
+        if (shard->lru_head != NULL) {
+            shard->lru_head->prev = entry;
+        } else {
+            shard->lru_tail = entry;
+        }
+        shard->lru_head = entry;
+        shard->size += rec->block_size;
+    }
+
+    snap_map = map;
+    snap_map_size = size;
+    return;
+}
+
+/*
+ * Periodic snapshot writer, so a crash loses at most
+ * SNAPSHOT_INTERVAL_SECS of cache warmth
+ *
+ * vargp: unused
+ */
+static void *snapshot_thread(void *vargp) {
+    pthread_mutex_lock(&snapshot_mutex);
+    while (snapshot_run) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += SNAPSHOT_INTERVAL_SECS;
+        pthread_cond_timedwait(&snapshot_stop, &snapshot_mutex, &ts);
+        if (!snapshot_run) {
+            break;
+        }
+        pthread_mutex_unlock(&snapshot_mutex);
+        cache_snapshot_save();
+        pthread_mutex_lock(&snapshot_mutex);
+    }
+    pthread_mutex_unlock(&snapshot_mutex);
+    return NULL;
+}
+
+/*
+ * Initialize every shard's lock, LRU list, size and hash index with the
+ * requested geometry. Passing 0 (or a negative value) for either size
+ * keeps the built-in default. The bucket count per shard is scaled so
+ * that, assuming entries average a few KB, chains stay short even with
+ * hundreds of thousands of entries. An object limit bigger than one
+ * shard's slice of the budget is clamped down so every admitted object
+ * can actually be stored.
+ *
+ * max_cache_bytes: total bytes of object data the cache may hold
+ * max_object_bytes: largest single object admitted
+ */
+void init_cache(ssize_t max_cache_bytes, ssize_t max_object_bytes) {
+
+    max_cache_size = max_cache_bytes > 0 ? max_cache_bytes
+                                         : DEFAULT_MAX_CACHE_SIZE;
+    max_object_size = max_object_bytes > 0 ? max_object_bytes
+                                           : DEFAULT_MAX_OBJECT_SIZE;
+    if (max_object_size > max_cache_size / CACHE_SHARDS) {
+        max_object_size = max_cache_size / CACHE_SHARDS;
+    }
+
+    // One bucket per ~4KB of capacity per shard, rounded up to a power
+    // of two within bounds
+    ssize_t per_shard = max_cache_size / CACHE_SHARDS;
+    shard_buckets = SHARD_BUCKETS_MIN;
+    while (shard_buckets < SHARD_BUCKETS_MAX &&
+           (ssize_t) shard_buckets * 4096 < per_shard) {
+        shard_buckets <<= 1;
+    }
+
+    memset(cm_sketch, 0, sizeof(cm_sketch));
+    cm_ops = 0;
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].mutex, NULL);
+        shards[i].lru_head = NULL;
+        shards[i].lru_tail = NULL;
+        shards[i].size = 0;
+        shards[i].buckets =
+            (Cache **) calloc(shard_buckets, sizeof(Cache *));
+    }
+
+    // Start warm from the previous run's snapshot, then keep a fresh
+    // one on disk in the background
+    cache_snapshot_load();
+    snapshot_run = 1;
+    pthread_create(&snapshot_tid, NULL, snapshot_thread, NULL);
+    return;
+}
+
+/*
+ * Largest single object the cache will admit; callers use this to
+ * decide when to stop accumulating a response copy
+ */
+ssize_t cache_max_object_size() {
+    return max_object_size;
+}
+
+/*
+ * Snapshot the entry set for the next run, then free any allocated
+ * blocks in every shard
  */
 void release_cache() {
-    Cache *cur = cache;
-    Cache *tmp;
-    while (cur) {
-        tmp = cur->next;
+    // Stop and join the snapshot thread before any teardown, so a save
+    // already in flight cannot walk freed shards or lock destroyed
+    // mutexes
+    pthread_mutex_lock(&snapshot_mutex);
+    snapshot_run = 0;
+    pthread_cond_signal(&snapshot_stop);
+    pthread_mutex_unlock(&snapshot_mutex);
+    pthread_join(snapshot_tid, NULL);
+
+    cache_snapshot_save();
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        Cache *cur = shards[i].lru_head;
+        Cache *tmp;
+        while (cur) {
+            tmp = cur->next;
 
-        cur->next = NULL;
-        cur->prev = NULL;
+            cur->next = NULL;
+            cur->prev = NULL;
 
-        free(cur->web_object);
-        free(cur->url);
-        free(cur);
+            slab_buf_free(cur->web_object);
+            free(cur->url);
+            slab_entry_free(cur);
 
-        cur = tmp;
+            cur = tmp;
+        }
+
+        shards[i].lru_head = NULL;
+        shards[i].lru_tail = NULL;
+        shards[i].size = 0;
+        free(shards[i].buckets);
+        shards[i].buckets = NULL;
+        pthread_mutex_destroy(&shards[i].mutex);
+    }
+
+    if (snap_map != NULL) {
+        munmap(snap_map, snap_map_size);
+        snap_map = NULL;
+        snap_map_size = 0;
     }
     return;
 }
 
- 
+
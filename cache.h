@@ -3,6 +3,7 @@
 #define __CACHE_H__
 
 #include <sys/types.h>
+#include <time.h>
 
 typedef struct Cache {
     char *url;
@@ -10,15 +11,23 @@ typedef struct Cache {
     ssize_t block_size;
     struct Cache *next;
     struct Cache *prev;
+    struct Cache *hnext;    /* next entry in the same hash bucket */
+    int refcount;           /* readers currently serving this entry */
+    int evicted;            /* unlinked; free when refcount drops to 0 */
+    time_t expires;         /* expiry time, or 0 for no expiry */
 } Cache;
 
 
-Cache *cache; 
-ssize_t cache_size;
-
 Cache *get_web_object(char *request_url);
+Cache *get_web_object_stale(char *request_url);
+void cache_refresh(char *url, int ttl_secs);
+void release_web_object(Cache *entry);
 void write_cache(char *url, char *web_object, ssize_t block_size);
-void init_cache();
+void write_cache_ttl(char *url, char *web_object, ssize_t block_size,
+                     int ttl_secs);
+void init_cache(ssize_t max_cache_bytes, ssize_t max_object_bytes);
+ssize_t cache_max_object_size();
+void cache_snapshot_save();
 void release_cache();
 
 
@@ -0,0 +1,228 @@
+
+/*
+ * Andrew Id: enhanc
+ * cachebench.c benchmarks the cache module directly, without sockets,
+ * so cache work is measured on its own instead of drowned in network
+ * noise. Built with "make cache-bench". Three scenario groups:
+ * lookup throughput across entry counts and hit ratios, insert/evict
+ * cycle throughput, and multi-threaded lookup contention against the
+ * shard locking scheme. Each scenario gets a freshly initialized cache
+ * sized so the working set fits (or, for the evict scenario, does
+ * not). The snapshot file the cache writes on release is deleted so a
+ * benchmark run never warms or poisons a real proxy start.
+ */
+
+#include "csapp.h"
+#include "cache.h"
+#include "slab.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Size of every benchmark object
+#define BENCH_OBJECT_BYTES 1024
+
+// Cache object limit used in every scenario
+#define BENCH_MAX_OBJECT 4096
+
+// Default operations per scenario, overridable on the command line
+#define BENCH_DEFAULT_OPS 200000
+
+// Written by release_cache; removed so benchmark urls never leak into
+// a real proxy's warm start
+#define BENCH_SNAPSHOT_FILE "proxy.cachesnap"
+
+/*
+ * Deterministic url for entry i; miss urls use a disjoint prefix
+ */
+static void bench_url(char *buf, int i, int miss) {
+    sprintf(buf, "http://bench.example/%s%d", miss ? "miss" : "obj", i);
+    return;
+}
+
+/*
+ * A fresh object buffer the cache can take ownership of
+ */
+static char *bench_object() {
+    char *buf = slab_buf_alloc(BENCH_OBJECT_BYTES);
+    memset(buf, 'x', BENCH_OBJECT_BYTES);
+    return buf;
+}
+
+/*
+ * Fill the cache with entries 0..count-1. Each url is looked up first,
+ * the way the proxy always does before a write, so the admission
+ * sketch knows it.
+ */
+static void bench_populate(int count) {
+    char url[MAXLINE];
+
+    for (int i = 0; i < count; i++) {
+        bench_url(url, i, 0);
+        get_web_object(url);
+        write_cache(url, bench_object(), BENCH_OBJECT_BYTES);
+    }
+    return;
+}
+
+/*
+ * One lookup with the given probability of hitting the populated set;
+ * misses draw from the disjoint miss url space
+ */
+static void bench_lookup_once(unsigned int *seed, int entries, int hit_pct) {
+    char url[MAXLINE];
+    int r = rand_r(seed);
+
+    bench_url(url, r % entries, (r % 100) >= hit_pct);
+    Cache *entry = get_web_object(url);
+    if (entry != NULL) {
+        release_web_object(entry);
+    }
+    return;
+}
+
+/*
+ * Single-threaded lookup throughput at one entry count and hit ratio
+ */
+static void bench_lookups(int entries, int hit_pct, long ops) {
+    unsigned int seed = 42;
+
+    init_cache((ssize_t) entries * BENCH_OBJECT_BYTES * 2, BENCH_MAX_OBJECT);
+    bench_populate(entries);
+
+    long start = stats_now_usecs();
+    for (long i = 0; i < ops; i++) {
+        bench_lookup_once(&seed, entries, hit_pct);
+    }
+    long usecs = stats_now_usecs() - start;
+
+    printf("lookup   entries=%-6d hit=%3d%%  %8.2f Mops/s\n",
+           entries, hit_pct, (double) ops / (usecs > 0 ? usecs : 1));
+
+    release_cache();
+    unlink(BENCH_SNAPSHOT_FILE);
+    return;
+}
+
+/*
+ * Insert/evict cycle throughput: the cache holds a fraction of the url
+ * stream, so once warm every insert evicts. Each new url is looked up
+ * twice first so its frequency beats the victim's and the admission
+ * filter lets the insert through to the evict path being measured.
+ */
+static void bench_insert_evict(long ops) {
+    char url[MAXLINE];
+
+    init_cache(512 * BENCH_OBJECT_BYTES, BENCH_MAX_OBJECT);
+
+    long start = stats_now_usecs();
+    for (long i = 0; i < ops; i++) {
+        bench_url(url, (int) i, 0);
+        get_web_object(url);
+        get_web_object(url);
+        write_cache(url, bench_object(), BENCH_OBJECT_BYTES);
+    }
+    long usecs = stats_now_usecs() - start;
+
+    printf("insert/evict cycles        %8.2f Mops/s\n",
+           (double) ops / (usecs > 0 ? usecs : 1));
+
+    release_cache();
+    unlink(BENCH_SNAPSHOT_FILE);
+    return;
+}
+
+/*
+ * Per-thread state for the contention scenario
+ */
+typedef struct {
+    pthread_t tid;
+    unsigned int seed;
+    int entries;
+    long ops;
+} bench_worker_t;
+
+static void *bench_worker(void *vargp) {
+    bench_worker_t *w = (bench_worker_t *) vargp;
+
+    for (long i = 0; i < w->ops; i++) {
+        bench_lookup_once(&w->seed, w->entries, 90);
+    }
+    return NULL;
+}
+
+/*
+ * Aggregate lookup throughput with nthreads hammering one cache at a
+ * 90% hit ratio, which is what exercises the shard locks
+ */
+static void bench_contention(int nthreads, int entries, long ops) {
+    bench_worker_t workers[64];
+
+    if (nthreads > 64) {
+        nthreads = 64;
+    }
+
+    init_cache((ssize_t) entries * BENCH_OBJECT_BYTES * 2, BENCH_MAX_OBJECT);
+    bench_populate(entries);
+
+    long start = stats_now_usecs();
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].seed = 42 + i;
+        workers[i].entries = entries;
+        workers[i].ops = ops;
+        pthread_create(&workers[i].tid, NULL, bench_worker, &workers[i]);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].tid, NULL);
+    }
+    long usecs = stats_now_usecs() - start;
+
+    printf("contention threads=%-2d      %8.2f Mops/s aggregate\n",
+           nthreads, (double) (ops * nthreads) / (usecs > 0 ? usecs : 1));
+
+    release_cache();
+    unlink(BENCH_SNAPSHOT_FILE);
+    return;
+}
+
+/*
+ * Run every scenario; an optional argument scales the per-scenario
+ * operation count
+ */
+int main(int argc, char **argv) {
+    long ops = BENCH_DEFAULT_OPS;
+
+    if (argc > 2 || (argc == 2 && atol(argv[1]) <= 0)) {
+        fprintf(stderr, "usage: %s [ops_per_scenario]\n", argv[0]);
+        exit(1);
+    }
+    if (argc == 2) {
+        ops = atol(argv[1]);
+    }
+
+    init_slab();
+    init_stats();
+    unlink(BENCH_SNAPSHOT_FILE);
+
+    int entry_counts[] = {1024, 4096, 16384};
+    int hit_ratios[] = {100, 90, 50, 0};
+    for (int e = 0; e < 3; e++) {
+        for (int h = 0; h < 4; h++) {
+            bench_lookups(entry_counts[e], hit_ratios[h], ops);
+        }
+    }
+
+    bench_insert_evict(ops);
+
+    int thread_counts[] = {1, 2, 4, 8};
+    for (int t = 0; t < 4; t++) {
+        bench_contention(thread_counts[t], 4096, ops);
+    }
+
+    release_slab();
+    return 0;
+}
@@ -0,0 +1,146 @@
+
+/*
+ * Andrew Id: enhanc
+ * connpool.c keeps idle persistent connections to origin servers so a
+ * cache miss to a host we have talked to before can reuse an already
+ * established TCP connection instead of paying a fresh handshake.
+ * Connections are keyed by hostname:port and kept on a single linked
+ * list protected by a mutex; the proxy fronts a small set of origins so
+ * a linear scan of the idle list is cheap. The list is bounded: when it
+ * is full, the oldest idle connection is closed to make room.
+ */
+
+#include "csapp.h"
+#include "connpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Upper bound on idle connections held across all origins
+#define POOL_MAX_IDLE 32
+
+/*
+ * One idle persistent connection to an origin server
+ */
+typedef struct idle_conn {
+    char *hostname;             /* origin host this fd is connected to */
+    char *port;                 /* origin port this fd is connected to */
+    int fd;                     /* the idle connected socket */
+    struct idle_conn *next;     /* next idle connection */
+} idle_conn;
+
+static idle_conn *idle_head;
+static int idle_count;
+static pthread_mutex_t pool_mutex;
+
+/*
+ * Initialize the pool lock and idle list
+ */
+void init_connpool() {
+    idle_head = NULL;
+    idle_count = 0;
+    pthread_mutex_init(&pool_mutex, NULL);
+    return;
+}
+
+/*
+ * Take an idle connection to hostname:port out of the pool. Return the
+ * connected fd, or -1 if no idle connection to that origin exists (the
+ * caller should dial a fresh one). The returned connection may have
+ * been closed by the origin while idle; callers must be prepared to
+ * retry on a fresh connection if the first request on it fails.
+ *
+ * hostname: origin host to look for
+ * port: origin port to look for
+ */
+int connpool_get(char *hostname, char *port) {
+    int fd = -1;
+
+    pthread_mutex_lock(&pool_mutex);
+    idle_conn **cur = &idle_head;
+    while (*cur != NULL) {
+        if (strcmp((*cur)->hostname, hostname) == 0 &&
+            strcmp((*cur)->port, port) == 0) {
+            idle_conn *found = *cur;
+            *cur = found->next;
+            idle_count--;
+
+            fd = found->fd;
+            free(found->hostname);
+            free(found->port);
+            free(found);
+            break;
+        }
+        cur = &(*cur)->next;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return fd;
+}
+
+/*
+ * Return a still-alive connection to the pool after a request on it
+ * completed. If the pool is full, the oldest idle connection is closed
+ * to keep the total bounded.
+ *
+ * hostname: origin host the fd is connected to
+ * port: origin port the fd is connected to
+ * fd: the connected socket to keep for reuse
+ */
+void connpool_put(char *hostname, char *port, int fd) {
+
+    idle_conn *entry = (idle_conn *) malloc(sizeof(idle_conn));
+    entry->hostname = (char *) malloc(strlen(hostname) + 1);
+    entry->port = (char *) malloc(strlen(port) + 1);
+    strcpy(entry->hostname, hostname);
+    strcpy(entry->port, port);
+    entry->fd = fd;
+
+    pthread_mutex_lock(&pool_mutex);
+
+    // Pool full: drop the oldest idle connection
+    if (idle_count == POOL_MAX_IDLE) {
+        idle_conn **cur = &idle_head;
+        while ((*cur)->next != NULL) {
+            cur = &(*cur)->next;
+        }
+        idle_conn *oldest = *cur;
+        *cur = NULL;
+        idle_count--;
+
+        close(oldest->fd);
+        free(oldest->hostname);
+        free(oldest->port);
+        free(oldest);
+    }
+
+    entry->next = idle_head;
+    idle_head = entry;
+    idle_count++;
+    pthread_mutex_unlock(&pool_mutex);
+    return;
+}
+
+/*
+ * Close every idle connection and free the pool
+ */
+void release_connpool() {
+    idle_conn *cur = idle_head;
+    idle_conn *tmp;
+    while (cur) {
+        tmp = cur->next;
+
+        close(cur->fd);
+        free(cur->hostname);
+        free(cur->port);
+        free(cur);
+
+        cur = tmp;
+    }
+    idle_head = NULL;
+    idle_count = 0;
+    pthread_mutex_destroy(&pool_mutex);
+    return;
+}
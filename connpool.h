@@ -0,0 +1,10 @@
+
+#ifndef __CONNPOOL_H__
+#define __CONNPOOL_H__
+
+void init_connpool();
+int connpool_get(char *hostname, char *port);
+void connpool_put(char *hostname, char *port, int fd);
+void release_connpool();
+
+#endif
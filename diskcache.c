@@ -0,0 +1,274 @@
+
+/*
+ * Andrew Id: enhanc
+ * diskcache.c is the second cache tier, for objects too large for the
+ * in-memory cache: exactly the 100KB-10MB static assets that are the
+ * most expensive to refetch. Each object lives in its own file under a
+ * directory next to the proxy; the index is a mutex-protected LRU list
+ * of url/size/sequence entries, in the same style as the in-memory
+ * cache but flat, since a handful of large objects never needs hash
+ * buckets. A writer streams an oversized response into a temp file as
+ * it relays it (so the whole object is never buffered in memory) and
+ * commits it with a rename; eviction walks the LRU tail unlinking
+ * files. A hit returns an open descriptor for the caller to sendfile
+ * from; because an unlinked file stays readable until the last
+ * descriptor closes, eviction needs no reference counting.
+ */
+
+#include "csapp.h"
+#include "diskcache.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Directory holding the object files, created at init
+#define DISK_CACHE_DIR "proxy.diskcache"
+
+/*
+ * One large object in the disk tier
+ */
+typedef struct disk_entry {
+    char *url;                  /* key */
+    unsigned long seq;          /* names the backing file */
+    ssize_t size;               /* bytes in the file */
+    struct disk_entry *prev;    /* toward most recently used */
+    struct disk_entry *next;    /* toward least recently used */
+} disk_entry_t;
+
+static disk_entry_t *lru_head;
+static disk_entry_t *lru_tail;
+static ssize_t used_bytes;
+static ssize_t capacity;
+static unsigned long next_seq;
+static pthread_mutex_t disk_mutex;
+
+/*
+ * Path of the backing file for a sequence number
+ */
+static void object_path(char *path, size_t cap, unsigned long seq) {
+    snprintf(path, cap, "%s/obj-%lu", DISK_CACHE_DIR, seq);
+    return;
+}
+
+/*
+ * Unlink an entry's file and free the entry. Caller holds the mutex
+ * and has already taken the entry off the list.
+ */
+static void destroy_entry(disk_entry_t *entry) {
+    char path[128];
+
+    object_path(path, sizeof(path), entry->seq);
+    unlink(path);
+    free(entry->url);
+    free(entry);
+    return;
+}
+
+/*
+ * Set up the tier with the given capacity. 0 disables it entirely:
+ * every call then reports a miss or refuses a write.
+ *
+ * max_disk_bytes: total bytes of object files to keep
+ */
+void init_diskcache(ssize_t max_disk_bytes) {
+    capacity = max_disk_bytes > 0 ? max_disk_bytes : 0;
+    lru_head = NULL;
+    lru_tail = NULL;
+    used_bytes = 0;
+    next_seq = 0;
+    pthread_mutex_init(&disk_mutex, NULL);
+    if (capacity > 0) {
+        mkdir(DISK_CACHE_DIR, 0700);
+    }
+    return;
+}
+
+/*
+ * Largest single object the tier admits; callers stop spilling a
+ * response once it grows past this
+ */
+ssize_t diskcache_max_object_size() {
+    return capacity / 4;
+}
+
+/*
+ * Look an url up in the disk tier. On a hit the entry moves to the
+ * front of the LRU list and an open read descriptor for its file is
+ * returned; the caller sendfiles from it and closes it. Returns -1 on
+ * a miss.
+ *
+ * url: url to look up
+ * size_out: receives the object's size on a hit
+ */
+int diskcache_get(char *url, ssize_t *size_out) {
+    char path[128];
+    disk_entry_t *cur;
+    int fd = -1;
+
+    pthread_mutex_lock(&disk_mutex);
+    for (cur = lru_head; cur != NULL; cur = cur->next) {
+        if (strcmp(url, cur->url) == 0) {
+            break;
+        }
+    }
+    if (cur == NULL) {
+        pthread_mutex_unlock(&disk_mutex);
+        return -1;
+    }
+
+    // Move to the front of the LRU list
+    if (cur != lru_head) {
+        cur->prev->next = cur->next;
+        if (cur->next != NULL) {
+            cur->next->prev = cur->prev;
+        } else {
+            lru_tail = cur->prev;
+        }
+        cur->prev = NULL;
+        cur->next = lru_head;
+        lru_head->prev = cur;
+        lru_head = cur;
+    }
+
+    object_path(path, sizeof(path), cur->seq);
+    fd = open(path, O_RDONLY);
+    *size_out = cur->size;
+    pthread_mutex_unlock(&disk_mutex);
+    return fd;
+}
+
+/*
+ * Open a temp file for a response being spilled to the disk tier.
+ * Returns its write descriptor, or -1 when the tier is disabled. The
+ * caller finishes with diskcache_commit or diskcache_abort.
+ *
+ * tmppath: receives the temp file's path for the later commit/abort
+ * pathcap: size of tmppath
+ */
+int diskcache_begin(char *tmppath, size_t pathcap) {
+    unsigned long seq;
+
+    if (capacity <= 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&disk_mutex);
+    seq = next_seq++;
+    pthread_mutex_unlock(&disk_mutex);
+
+    snprintf(tmppath, pathcap, "%s/tmp-%lu", DISK_CACHE_DIR, seq);
+    return open(tmppath, O_CREAT | O_EXCL | O_WRONLY, 0600);
+}
+
+/*
+ * Publish a fully spilled response: rename the temp file into place,
+ * index it, and evict least recently used objects until it fits. A
+ * duplicate insert (another thread spilled the same url first) is
+ * discarded.
+ *
+ * url: key of the object (copied)
+ * fd: write descriptor from diskcache_begin
+ * tmppath: temp file path from diskcache_begin
+ * size: bytes written to the file
+ */
+void diskcache_commit(char *url, int fd, char *tmppath, ssize_t size) {
+    char path[128];
+    disk_entry_t *cur;
+
+    close(fd);
+    if (size > diskcache_max_object_size()) {
+        unlink(tmppath);
+        return;
+    }
+
+    pthread_mutex_lock(&disk_mutex);
+
+    for (cur = lru_head; cur != NULL; cur = cur->next) {
+        if (strcmp(url, cur->url) == 0) {
+            pthread_mutex_unlock(&disk_mutex);
+            unlink(tmppath);
+            return;
+        }
+    }
+
+    // Evict from the tail until the new object fits
+    while (used_bytes + size > capacity && lru_tail != NULL) {
+        disk_entry_t *victim = lru_tail;
+
+        lru_tail = victim->prev;
+        if (lru_tail != NULL) {
+            lru_tail->next = NULL;
+        } else {
+            lru_head = NULL;
+        }
+        used_bytes -= victim->size;
+        stats_count_eviction();
+        destroy_entry(victim);
+    }
+
+    disk_entry_t *entry = (disk_entry_t *) malloc(sizeof(disk_entry_t));
+    entry->url = (char *) malloc(strlen(url) + 1);
+    strcpy(entry->url, url);
+    entry->seq = next_seq++;
+    entry->size = size;
+
+    object_path(path, sizeof(path), entry->seq);
+    if (rename(tmppath, path) < 0) {
+        pthread_mutex_unlock(&disk_mutex);
+        free(entry->url);
+        free(entry);
+        unlink(tmppath);
+        return;
+    }
+
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->prev = entry;
+    } else {
+        lru_tail = entry;
+    }
+    lru_head = entry;
+    used_bytes += size;
+    pthread_mutex_unlock(&disk_mutex);
+    return;
+}
+
+/*
+ * Throw a half-written spill away
+ *
+ * fd: write descriptor from diskcache_begin
+ * tmppath: temp file path from diskcache_begin
+ */
+void diskcache_abort(int fd, char *tmppath) {
+    close(fd);
+    unlink(tmppath);
+    return;
+}
+
+/*
+ * Unlink every object file and free the index
+ */
+void release_diskcache() {
+    disk_entry_t *cur = lru_head;
+
+    while (cur != NULL) {
+        disk_entry_t *tmp = cur->next;
+        destroy_entry(cur);
+        cur = tmp;
+    }
+    lru_head = NULL;
+    lru_tail = NULL;
+    used_bytes = 0;
+    if (capacity > 0) {
+        rmdir(DISK_CACHE_DIR);
+    }
+    pthread_mutex_destroy(&disk_mutex);
+    return;
+}
@@ -0,0 +1,15 @@
+
+#ifndef __DISKCACHE_H__
+#define __DISKCACHE_H__
+
+#include <sys/types.h>
+
+void init_diskcache(ssize_t max_disk_bytes);
+ssize_t diskcache_max_object_size();
+int diskcache_get(char *url, ssize_t *size_out);
+int diskcache_begin(char *tmppath, size_t pathcap);
+void diskcache_commit(char *url, int fd, char *tmppath, ssize_t size);
+void diskcache_abort(int fd, char *tmppath);
+void release_diskcache();
+
+#endif
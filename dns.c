@@ -0,0 +1,239 @@
+
+/*
+ * Andrew Id: enhanc
+ * dns.c caches resolved origin addresses so a cache miss does not pay a
+ * getaddrinfo round trip to the resolver every time. Entries are keyed
+ * on hostname:port and hold the resolved sockaddr list with a TTL;
+ * failed resolutions are cached too (with a much shorter TTL) so a dead
+ * hostname or a resolver brownout does not hammer the resolver on every
+ * request. The proxy fronts fewer than a hundred distinct origins, so
+ * the cache is a mutex-protected linear list like the connection pool.
+ * csapp.c is left untouched per the handout; dns_open_clientfd is the
+ * cache-aware stand-in for open_clientfd.
+ */
+
+#include "csapp.h"
+#include "dns.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+// How long a successful resolution stays valid
+#define DNS_TTL_SECS 60
+
+// How long a failed resolution is remembered
+#define DNS_NEG_TTL_SECS 5
+
+// Most addresses kept per hostname
+#define DNS_MAX_ADDRS 8
+
+/*
+ * One cached resolution; naddrs == 0 marks a cached failure
+ */
+typedef struct dns_entry {
+    char *hostname;                                 /* key host */
+    char *port;                                     /* key port */
+    int naddrs;                                     /* addresses held */
+    struct sockaddr_storage addrs[DNS_MAX_ADDRS];   /* resolved addrs */
+    socklen_t addrlens[DNS_MAX_ADDRS];              /* their lengths */
+    time_t expires;                                 /* entry valid until */
+    struct dns_entry *next;                         /* next cached host */
+} dns_entry_t;
+
+static dns_entry_t *dns_head;
+static pthread_mutex_t dns_mutex;
+
+/*
+ * Initialize the cache lock and entry list
+ */
+void init_dns() {
+    dns_head = NULL;
+    pthread_mutex_init(&dns_mutex, NULL);
+    return;
+}
+
+/*
+ * Drop a cached resolution. Caller holds dns_mutex and passes the link
+ * that points at the entry.
+ */
+static void dns_drop(dns_entry_t **link) {
+    dns_entry_t *e = *link;
+    *link = e->next;
+    free(e->hostname);
+    free(e->port);
+    free(e);
+    return;
+}
+
+/*
+ * Insert a resolution result (or a failure when naddrs is 0). Caller
+ * holds dns_mutex.
+ */
+static void dns_insert(char *hostname, char *port, int naddrs,
+                       struct sockaddr_storage *addrs, socklen_t *addrlens) {
+    dns_entry_t *e = (dns_entry_t *) malloc(sizeof(dns_entry_t));
+
+    e->hostname = (char *) malloc(strlen(hostname) + 1);
+    e->port = (char *) malloc(strlen(port) + 1);
+    strcpy(e->hostname, hostname);
+    strcpy(e->port, port);
+    e->naddrs = naddrs;
+    for (int i = 0; i < naddrs; i++) {
+        e->addrs[i] = addrs[i];
+        e->addrlens[i] = addrlens[i];
+    }
+    e->expires = time(NULL) +
+                 (naddrs > 0 ? DNS_TTL_SECS : DNS_NEG_TTL_SECS);
+    e->next = dns_head;
+    dns_head = e;
+    return;
+}
+
+/*
+ * Resolve hostname:port through the cache. Fills in up to max_addrs
+ * resolved addresses and returns how many were stored. Returns 0 when
+ * resolution fails, including when the failure itself is cached and the
+ * resolver was not consulted at all.
+ *
+ * hostname: origin host to resolve
+ * port: origin port (numeric service)
+ * addrs: output array for resolved addresses
+ * addrlens: output array for their lengths
+ * max_addrs: capacity of the output arrays
+ */
+int dns_resolve(char *hostname, char *port, struct sockaddr_storage *addrs,
+                socklen_t *addrlens, int max_addrs) {
+    struct addrinfo hints, *listp, *p;
+    struct sockaddr_storage fresh[DNS_MAX_ADDRS];
+    socklen_t freshlens[DNS_MAX_ADDRS];
+    int naddrs = 0;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&dns_mutex);
+    dns_entry_t **link = &dns_head;
+    while (*link != NULL) {
+        dns_entry_t *e = *link;
+        if (strcmp(e->hostname, hostname) == 0 &&
+            strcmp(e->port, port) == 0) {
+            if (e->expires <= now) {
+                dns_drop(link);
+                break;
+            }
+            naddrs = e->naddrs < max_addrs ? e->naddrs : max_addrs;
+            for (int i = 0; i < naddrs; i++) {
+                addrs[i] = e->addrs[i];
+                addrlens[i] = e->addrlens[i];
+            }
+            int cached_failure = (e->naddrs == 0);
+            pthread_mutex_unlock(&dns_mutex);
+            return cached_failure ? 0 : naddrs;
+        }
+        link = &e->next;
+    }
+    pthread_mutex_unlock(&dns_mutex);
+
+    // Not cached (or expired): ask the resolver
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(hostname, port, &hints, &listp) != 0) {
+        pthread_mutex_lock(&dns_mutex);
+        dns_insert(hostname, port, 0, NULL, NULL);
+        pthread_mutex_unlock(&dns_mutex);
+        return 0;
+    }
+
+    for (p = listp; p != NULL && naddrs < DNS_MAX_ADDRS; p = p->ai_next) {
+        memcpy(&fresh[naddrs], p->ai_addr, p->ai_addrlen);
+        freshlens[naddrs] = p->ai_addrlen;
+        naddrs++;
+    }
+    freeaddrinfo(listp);
+
+    pthread_mutex_lock(&dns_mutex);
+    dns_insert(hostname, port, naddrs, fresh, freshlens);
+    pthread_mutex_unlock(&dns_mutex);
+
+    if (naddrs > max_addrs) {
+        naddrs = max_addrs;
+    }
+    for (int i = 0; i < naddrs; i++) {
+        addrs[i] = fresh[i];
+        addrlens[i] = freshlens[i];
+    }
+    return naddrs;
+}
+
+/*
+ * Cache-aware replacement for open_clientfd: resolve through the cache
+ * and connect to the first address that accepts. If every cached
+ * address refuses (the origin may have moved while the entry aged), the
+ * entry is invalidated and resolution is retried once. Returns the
+ * connected fd or -1.
+ *
+ * hostname: origin host to connect to
+ * port: origin port
+ */
+int dns_open_clientfd(char *hostname, char *port) {
+    struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+    socklen_t addrlens[DNS_MAX_ADDRS];
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int naddrs = dns_resolve(hostname, port, addrs, addrlens,
+                                 DNS_MAX_ADDRS);
+        if (naddrs == 0) {
+            return -1;
+        }
+
+        for (int i = 0; i < naddrs; i++) {
+            int fd = socket(addrs[i].ss_family, SOCK_STREAM, 0);
+            if (fd < 0) {
+                continue;
+            }
+            if (connect(fd, (struct sockaddr *) &addrs[i],
+                        addrlens[i]) == 0) {
+                return fd;
+            }
+            close(fd);
+        }
+
+        // Every address failed: drop the stale entry and re-resolve
+        pthread_mutex_lock(&dns_mutex);
+        dns_entry_t **link = &dns_head;
+        while (*link != NULL) {
+            if (strcmp((*link)->hostname, hostname) == 0 &&
+                strcmp((*link)->port, port) == 0) {
+                dns_drop(link);
+                break;
+            }
+            link = &(*link)->next;
+        }
+        pthread_mutex_unlock(&dns_mutex);
+    }
+    return -1;
+}
+
+/*
+ * Free every cached resolution
+ */
+void release_dns() {
+    dns_entry_t *cur = dns_head;
+    dns_entry_t *tmp;
+    while (cur) {
+        tmp = cur->next;
+        free(cur->hostname);
+        free(cur->port);
+        free(cur);
+        cur = tmp;
+    }
+    dns_head = NULL;
+    pthread_mutex_destroy(&dns_mutex);
+    return;
+}
@@ -0,0 +1,13 @@
+
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include <sys/socket.h>
+
+void init_dns();
+int dns_resolve(char *hostname, char *port, struct sockaddr_storage *addrs,
+                socklen_t *addrlens, int max_addrs);
+int dns_open_clientfd(char *hostname, char *port);
+void release_dns();
+
+#endif
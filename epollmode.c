@@ -0,0 +1,613 @@
+
+/*
+ * Andrew Id: enhanc
+ * epollmode.c implements the event-driven alternative to the blocking
+ * worker-pool proxy. One event loop thread drives every connection
+ * through a small per-connection state machine over non-blocking
+ * sockets: read the client request, look it up in the cache, connect to
+ * the origin, forward the request, then relay the response while
+ * accumulating a cacheable copy. A connection therefore costs one small
+ * state struct instead of a whole thread stack, which is what makes
+ * tens of thousands of mostly idle clients affordable. The cache module
+ * is shared with the threaded mode; upstream requests are sent with
+ * Connection: close so the end of a response is simply the origin
+ * closing, keeping the relay state machine free of body framing.
+ */
+
+#include "csapp.h"
+#include "cache.h"
+#include "slab.h"
+#include "dns.h"
+#include "uri.h"
+#include "epollmode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+// How many ready events one epoll_wait call may return
+#define EPOLL_BATCH 64
+
+// Matches the User-Agent sent by the threaded mode in proxy.c
+static const char *epoll_user_agent = "Mozilla/5.0"
+                                    " (X11; Linux x86_64; rv:3.10.0)"
+                                    " Gecko/20190801 Firefox/63.0.1";
+
+/*
+ * Phases a connection moves through
+ */
+typedef enum {
+    ST_REQ_READ,    /* reading the client request and headers */
+    ST_HIT_WRITE,   /* writing a cached object to the client */
+    ST_UP_CONNECT,  /* waiting for the non-blocking connect to finish */
+    ST_UP_WRITE,    /* writing the rebuilt request to the origin */
+    ST_RELAY        /* moving response bytes origin -> client */
+} conn_state_t;
+
+/*
+ * Per-connection state; this struct is all the memory an in-flight
+ * connection costs
+ */
+typedef struct econn {
+    int cfd;                /* client socket */
+    int ufd;                /* origin socket, -1 until connected */
+    conn_state_t state;
+
+    char req[MAXLINE];      /* raw client request text */
+    size_t req_len;
+
+    char out[MAXLINE];      /* rebuilt request headed upstream */
+    size_t out_len;
+    size_t out_sent;
+
+    char url[MAXLINE];      /* cache key for this request */
+
+    Cache *entry;           /* pinned entry when serving a hit */
+    ssize_t entry_sent;
+
+    char relay[MAXLINE];    /* response chunk in flight to the client */
+    ssize_t relay_len;
+    ssize_t relay_sent;
+    int up_eof;             /* origin finished sending */
+
+    char *acc;              /* cacheable copy; NULL once abandoned */
+    ssize_t acc_size;
+    ssize_t acc_cap;
+
+    struct fdinfo *cinfo;   /* epoll registration of the client socket */
+    struct fdinfo *uinfo;   /* epoll registration of the origin socket */
+} econn_t;
+
+/*
+ * epoll_data payload: which connection an event belongs to and whether
+ * it fired on the origin or the client socket
+ */
+typedef struct fdinfo {
+    econn_t *conn;
+    int is_upstream;
+} fdinfo_t;
+
+static int epfd;
+
+static void conn_close(econn_t *c);
+
+/*
+ * Put a socket into non-blocking mode
+ */
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    return;
+}
+
+/*
+ * Register a socket with the event loop. Returns the registration
+ * record (needed later to change the event mask), or NULL on failure.
+ *
+ * fd: socket to watch
+ * events: EPOLLIN/EPOLLOUT mask to wait for
+ * conn: connection the socket belongs to (NULL for the listen socket)
+ * is_upstream: whether fd is the connection's origin socket
+ */
+static fdinfo_t *ep_add(int fd, unsigned int events, econn_t *conn,
+                        int is_upstream) {
+    struct epoll_event ev;
+    fdinfo_t *info = (fdinfo_t *) malloc(sizeof(fdinfo_t));
+
+    info->conn = conn;
+    info->is_upstream = is_upstream;
+    ev.events = events;
+    ev.data.ptr = info;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        free(info);
+        return NULL;
+    }
+    return info;
+}
+
+/*
+ * Change the event mask a registered socket is waiting for
+ */
+static void ep_mod(int fd, unsigned int events, fdinfo_t *info) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = info;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+    return;
+}
+
+/*
+ * Append response data to the connection's cacheable copy, abandoning
+ * the copy once it cannot fit in the cache
+ */
+static void acc_append(econn_t *c, char *buf, ssize_t buflen) {
+    if (c->acc == NULL) {
+        return;
+    }
+    if (c->acc_size + buflen > cache_max_object_size()) {
+        slab_buf_free(c->acc);
+        c->acc = NULL;
+        return;
+    }
+    if (c->acc_size + buflen > c->acc_cap) {
+        ssize_t newcap = c->acc_cap * 2;
+        if (newcap < c->acc_size + buflen) {
+            newcap = c->acc_size + buflen;
+        }
+        if (newcap > cache_max_object_size()) {
+            newcap = cache_max_object_size();
+        }
+        char *newbuf = slab_buf_alloc(newcap);
+        memcpy(newbuf, c->acc, c->acc_size);
+        slab_buf_free(c->acc);
+        c->acc = newbuf;
+        c->acc_cap = newcap;
+    }
+    memcpy(c->acc + c->acc_size, buf, buflen);
+    c->acc_size += buflen;
+    return;
+}
+
+/*
+ * Rebuild the client's request for the origin, mirroring the header
+ * policy of build_requesthdrs in proxy.c but working over the in-memory
+ * request text instead of a rio stream. Connection is set to close so
+ * the relay can treat origin EOF as end of response.
+ *
+ * c: connection whose req buffer holds the full client request
+ * uv: parsed views of the requested uri
+ */
+static void build_upstream_request(econn_t *c, const uri_view_t *uv) {
+    size_t len = 0;
+    char *line = c->req;
+
+    len += snprintf(c->out + len, MAXLINE - len, "GET %.*s HTTP/1.0\r\n",
+                    (int) uv->path_len, uv->path);
+    if (!uri_default_port(uv)) {
+        len += snprintf(c->out + len, MAXLINE - len, "Host: %.*s:%.*s\r\n",
+                        (int) uv->host_len, uv->host,
+                        (int) uv->port_len, uv->port);
+    } else {
+        len += snprintf(c->out + len, MAXLINE - len, "Host: %.*s\r\n",
+                        (int) uv->host_len, uv->host);
+    }
+    len += snprintf(c->out + len, MAXLINE - len, "User-Agent: %s\r\n",
+                    epoll_user_agent);
+    len += snprintf(c->out + len, MAXLINE - len, "Connection: close\r\n");
+    if (len > MAXLINE - 3) {
+        len = MAXLINE - 3;
+    }
+
+    // Walk the client's header lines, skipping the request line and any
+    // header the proxy sets itself
+    line = strstr(line, "\r\n");
+    while (line != NULL) {
+        char *next;
+
+        line += 2;
+        next = strstr(line, "\r\n");
+        if (next == NULL || next == line) {
+            break;
+        }
+        size_t n = (next + 2) - line;
+
+        if (strncasecmp(line, "Host:", 5) != 0 &&
+            strncasecmp(line, "User-Agent:", 11) != 0 &&
+            strncasecmp(line, "Connection:", 11) != 0 &&
+            strncasecmp(line, "Proxy-Connection:", 17) != 0 &&
+            len + n <= MAXLINE - 3) {
+            memcpy(c->out + len, line, n);
+            len += n;
+        }
+        line = next;
+    }
+
+    memcpy(c->out + len, "\r\n", 2);
+    c->out_len = len + 2;
+    c->out_sent = 0;
+    return;
+}
+
+/*
+ * Tear a connection down: unregister and close its sockets, release any
+ * pinned cache entry and drop the cacheable copy
+ */
+static void conn_close(econn_t *c) {
+    if (c->cfd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->cfd, NULL);
+        close(c->cfd);
+    }
+    if (c->ufd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->ufd, NULL);
+        close(c->ufd);
+    }
+    if (c->entry != NULL) {
+        release_web_object(c->entry);
+    }
+    free(c->cinfo);
+    free(c->uinfo);
+    slab_buf_free(c->acc);
+    free(c);
+    return;
+}
+
+/*
+ * The full client request has arrived: parse it, serve from cache on a
+ * hit, otherwise start the non-blocking origin connect
+ */
+static void process_request(econn_t *c) {
+    char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char hostname[256], port[16];
+    uri_view_t uv;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int rc;
+
+    if (sscanf(c->req, "%s %s %s", method, uri, version) != 3 ||
+        strcasecmp(method, "GET") != 0) {
+        conn_close(c);
+        return;
+    }
+
+    strcpy(c->url, uri);
+    c->entry = get_web_object(c->url);
+    if (c->entry != NULL) {
+        // Cache hit: switch the client socket to writable events and
+        // stream the pinned object out
+        c->state = ST_HIT_WRITE;
+        c->entry_sent = 0;
+        ep_mod(c->cfd, EPOLLOUT, c->cinfo);
+        return;
+    }
+
+    if (parse_uri(uri, &uv) < 0 ||
+        uri_host_port_cstr(&uv, hostname, sizeof(hostname),
+                           port, sizeof(port)) < 0) {
+        conn_close(c);
+        return;
+    }
+    build_upstream_request(c, &uv);
+
+    // Resolve through the shared DNS cache and start a non-blocking
+    // connect; completion is reported as the socket turning writable
+    if (dns_resolve(hostname, port, &addr, &addrlen, 1) == 0) {
+        conn_close(c);
+        return;
+    }
+
+    c->ufd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (c->ufd < 0) {
+        conn_close(c);
+        return;
+    }
+    set_nonblocking(c->ufd);
+    rc = connect(c->ufd, (struct sockaddr *) &addr, addrlen);
+    if (rc < 0 && errno != EINPROGRESS) {
+        conn_close(c);
+        return;
+    }
+
+    c->state = ST_UP_CONNECT;
+    c->uinfo = ep_add(c->ufd, EPOLLOUT, c, 1);
+    if (c->uinfo == NULL) {
+        conn_close(c);
+        return;
+    }
+
+    // The request is in hand: go quiet on the client socket until the
+    // relay needs it. Leaving level-triggered EPOLLIN armed would make
+    // every poll return immediately for a client that pipelines its
+    // next request, spinning the loop for the whole origin fetch.
+    // EPOLLERR/EPOLLHUP are still reported on a mask of 0, so a torn
+    // down client is noticed.
+    ep_mod(c->cfd, 0, c->cinfo);
+
+    // Start the cacheable copy for the response
+    c->acc = slab_buf_alloc(MAXLINE);
+    c->acc_size = 0;
+    c->acc_cap = MAXLINE;
+    return;
+}
+
+/*
+ * Relay helper: push the in-flight chunk to the client. Returns 1 if
+ * the chunk drained, 0 if the client is not keeping up (caller switches
+ * to waiting for client writability), -1 on error.
+ */
+static int flush_relay(econn_t *c) {
+    while (c->relay_sent < c->relay_len) {
+        ssize_t n = write(c->cfd, c->relay + c->relay_sent,
+                          c->relay_len - c->relay_sent);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        c->relay_sent += n;
+    }
+    c->relay_len = 0;
+    c->relay_sent = 0;
+    return 1;
+}
+
+/*
+ * The relay finished cleanly: insert the accumulated copy into the
+ * cache (ownership transfers) and close the connection. Only 200
+ * responses are cached: this mode sends Connection: close upstream, so
+ * a pass-through conditional GET ends in a clean 304 at EOF, and
+ * storing that (or an error status) would answer later unconditional
+ * requests with the wrong response.
+ */
+static void finish_relay(econn_t *c) {
+    if (c->acc != NULL) {
+        // The accumulated copy starts at the status line but is not
+        // NUL-terminated; parse the status from a bounded copy
+        char statline[16];
+        int status = -1;
+        ssize_t n = c->acc_size < 15 ? c->acc_size : 15;
+        memcpy(statline, c->acc, n);
+        statline[n] = '\0';
+        sscanf(statline, "%*s %d", &status);
+        if (status == 200) {
+            write_cache(c->url, c->acc, c->acc_size);
+            c->acc = NULL;
+        }
+    }
+    conn_close(c);
+    return;
+}
+
+/*
+ * Handle an event on a connection's client socket
+ */
+static void handle_client_event(fdinfo_t *info) {
+    econn_t *c = info->conn;
+    ssize_t n;
+
+    switch (c->state) {
+
+    case ST_REQ_READ:
+        // Accumulate request bytes until the blank line ends the headers
+        while ((n = read(c->cfd, c->req + c->req_len,
+                         MAXLINE - 1 - c->req_len)) > 0) {
+            c->req_len += n;
+            c->req[c->req_len] = '\0';
+            if (strstr(c->req, "\r\n\r\n") != NULL) {
+                process_request(c);
+                return;
+            }
+            if (c->req_len >= MAXLINE - 1) {
+                conn_close(c);
+                return;
+            }
+        }
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            conn_close(c);
+        }
+        return;
+
+    case ST_HIT_WRITE:
+        while (c->entry_sent < c->entry->block_size) {
+            n = write(c->cfd, c->entry->web_object + c->entry_sent,
+                      c->entry->block_size - c->entry_sent);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return;
+                }
+                conn_close(c);
+                return;
+            }
+            c->entry_sent += n;
+        }
+        conn_close(c);
+        return;
+
+    case ST_RELAY: {
+        // The client drained enough to accept more; resume pulling from
+        // the origin
+        int rc = flush_relay(c);
+        if (rc < 0) {
+            conn_close(c);
+            return;
+        }
+        if (rc == 1) {
+            if (c->up_eof) {
+                finish_relay(c);
+                return;
+            }
+            // Chunk drained: go quiet on the client and resume reading
+            // the origin
+            ep_mod(c->cfd, 0, c->cinfo);
+            ep_mod(c->ufd, EPOLLIN, c->uinfo);
+        }
+        return;
+    }
+
+    default: {
+        // The client mask is 0 while waiting on the origin, so only
+        // EPOLLERR/EPOLLHUP land here; confirm the hangup and tear the
+        // connection down
+        char tmp[1];
+        n = recv(c->cfd, tmp, 1, MSG_PEEK);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            conn_close(c);
+        }
+        return;
+    }
+    }
+}
+
+/*
+ * Handle an event on a connection's origin socket
+ */
+static void handle_upstream_event(fdinfo_t *info) {
+    econn_t *c = info->conn;
+    ssize_t n;
+
+    switch (c->state) {
+
+    case ST_UP_CONNECT: {
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        getsockopt(c->ufd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+        if (err != 0) {
+            conn_close(c);
+            return;
+        }
+        c->state = ST_UP_WRITE;
+    }
+    // fall through: the socket is writable now
+
+    case ST_UP_WRITE:
+        while (c->out_sent < c->out_len) {
+            n = write(c->ufd, c->out + c->out_sent, c->out_len - c->out_sent);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return;
+                }
+                conn_close(c);
+                return;
+            }
+            c->out_sent += n;
+        }
+        c->state = ST_RELAY;
+        ep_mod(c->ufd, EPOLLIN, info);
+        return;
+
+    case ST_RELAY:
+        // Pull response bytes and push them to the client until one of
+        // the sockets stops cooperating
+        while (1) {
+            if (c->relay_len > c->relay_sent) {
+                int rc = flush_relay(c);
+                if (rc < 0) {
+                    conn_close(c);
+                    return;
+                }
+                if (rc == 0) {
+                    // Client is the bottleneck: stop reading the origin
+                    // and wait for the client to become writable
+                    ep_mod(c->ufd, 0, c->uinfo);
+                    ep_mod(c->cfd, EPOLLOUT, c->cinfo);
+                    return;
+                }
+            }
+
+            n = read(c->ufd, c->relay, MAXLINE);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return;
+                }
+                conn_close(c);
+                return;
+            }
+            if (n == 0) {
+                c->up_eof = 1;
+                if (c->relay_len == c->relay_sent) {
+                    finish_relay(c);
+                }
+                return;
+            }
+            c->relay_len = n;
+            c->relay_sent = 0;
+            acc_append(c, c->relay, n);
+        }
+        return;
+
+    default:
+        return;
+    }
+}
+
+/*
+ * Run the proxy as a single-threaded epoll event loop on the given
+ * port. Never returns except on a fatal setup error.
+ *
+ * port: port to listen on
+ */
+int run_epoll_mode(char *port) {
+    int listenfd;
+    struct epoll_event events[EPOLL_BATCH];
+
+    listenfd = open_listenfd(port);
+    if (listenfd < 0) {
+        fprintf(stderr, "Failed to listen on port: %s\n", port);
+        return -1;
+    }
+    set_nonblocking(listenfd);
+
+    epfd = epoll_create1(0);
+    if (epfd < 0) {
+        fprintf(stderr, "epoll_create1 failed\n");
+        return -1;
+    }
+    if (ep_add(listenfd, EPOLLIN, NULL, 0) == NULL) {
+        fprintf(stderr, "Failed to register listen socket\n");
+        return -1;
+    }
+
+    while (1) {
+        int nready = epoll_wait(epfd, events, EPOLL_BATCH, -1);
+
+        for (int i = 0; i < nready; i++) {
+            fdinfo_t *info = (fdinfo_t *) events[i].data.ptr;
+
+            if (info->conn == NULL) {
+                // New connections on the listen socket
+                while (1) {
+                    int connfd = accept(listenfd, NULL, NULL);
+                    if (connfd < 0) {
+                        break;
+                    }
+                    set_nonblocking(connfd);
+
+                    econn_t *c = (econn_t *) calloc(1, sizeof(econn_t));
+                    c->cfd = connfd;
+                    c->ufd = -1;
+                    c->state = ST_REQ_READ;
+                    c->cinfo = ep_add(connfd, EPOLLIN, c, 0);
+                    if (c->cinfo == NULL) {
+                        close(connfd);
+                        free(c);
+                    }
+                }
+                continue;
+            }
+
+            if (info->is_upstream) {
+                handle_upstream_event(info);
+            } else {
+                handle_client_event(info);
+            }
+        }
+    }
+    return 0;
+}
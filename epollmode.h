@@ -0,0 +1,7 @@
+
+#ifndef __EPOLLMODE_H__
+#define __EPOLLMODE_H__
+
+int run_epoll_mode(char *port);
+
+#endif
@@ -0,0 +1,176 @@
+
+/*
+ * Andrew Id: enhanc
+ * log.c moves logging off the request hot path. Worker threads format a
+ * fixed-size record and publish it into a lock-free multi-producer ring
+ * buffer: a producer claims a ticket with a compare-and-swap, fills the
+ * slot, then flips the slot's sequence word to hand it to the consumer,
+ * so no thread ever blocks on a stdio lock while holding a connection.
+ * A dedicated logger thread is the only consumer; it drains ready
+ * records to stderr in order and naps briefly when the ring is empty.
+ * When producers outrun the drain the record is dropped and counted
+ * rather than stalling the worker; the drop total is reported in the
+ * stream once the ring empties out. log_access formats the standard
+ * per-request line (method, URI, status, bytes, hit/miss, latency).
+ */
+
+#include "log.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// Ring capacity; power of two so indexes can be masked
+#define LOG_SLOTS 1024
+
+// Fixed record size; longer messages are truncated
+#define LOG_MSG_MAX 256
+
+/*
+ * One ring slot. seq is 0 while the slot is free and ticket+1 once the
+ * producer has filled text, which is the consumer's signal to print it.
+ */
+typedef struct {
+    unsigned long seq;
+    char text[LOG_MSG_MAX];
+} log_slot_t;
+
+static log_slot_t ring[LOG_SLOTS];
+static unsigned long widx;      /* next ticket producers claim */
+static unsigned long ridx;      /* next ticket the logger consumes */
+static long dropped;            /* records lost to a full ring */
+static pthread_t logger_tid;
+static int logger_run;
+
+/*
+ * Publish one formatted record into the ring, dropping it if the ring
+ * is full
+ *
+ * text: NUL-terminated record, newline included
+ */
+static void log_enqueue(const char *text) {
+    unsigned long w;
+
+    for (;;) {
+        w = __atomic_load_n(&widx, __ATOMIC_RELAXED);
+        if (w - __atomic_load_n(&ridx, __ATOMIC_ACQUIRE) >= LOG_SLOTS) {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        if (__atomic_compare_exchange_n(&widx, &w, w + 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    log_slot_t *slot = &ring[w & (LOG_SLOTS - 1)];
+    strncpy(slot->text, text, LOG_MSG_MAX - 1);
+    slot->text[LOG_MSG_MAX - 1] = '\0';
+
+    // Hand the filled slot to the logger thread
+    __atomic_store_n(&slot->seq, w + 1, __ATOMIC_RELEASE);
+    return;
+}
+
+/*
+ * Logger thread body: the single consumer of the ring. Drains ready
+ * records in ticket order; on an empty ring it reports any accumulated
+ * drops and naps so an idle proxy burns no cycles.
+ */
+static void *logger_thread(void *vargp) {
+    struct timespec nap = {0, 2 * 1000 * 1000};
+
+    while (1) {
+        unsigned long r = __atomic_load_n(&ridx, __ATOMIC_RELAXED);
+        log_slot_t *slot = &ring[r & (LOG_SLOTS - 1)];
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == r + 1) {
+            fputs(slot->text, stderr);
+            __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&ridx, r + 1, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        long d = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+        if (d > 0) {
+            fprintf(stderr, "log: %ld records dropped\n", d);
+            __atomic_fetch_sub(&dropped, d, __ATOMIC_RELAXED);
+        }
+
+        if (!__atomic_load_n(&logger_run, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        nanosleep(&nap, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * Start the logger thread with an empty ring
+ */
+void init_log() {
+    for (int i = 0; i < LOG_SLOTS; i++) {
+        ring[i].seq = 0;
+    }
+    widx = 0;
+    ridx = 0;
+    dropped = 0;
+    logger_run = 1;
+    pthread_create(&logger_tid, NULL, logger_thread, NULL);
+    return;
+}
+
+/*
+ * printf-style logging that never blocks the caller; the record goes
+ * into the ring for the logger thread to print
+ */
+void log_printf(const char *fmt, ...) {
+    char text[LOG_MSG_MAX];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(text, sizeof(text) - 1, fmt, ap);
+    va_end(ap);
+
+    if (len < 0) {
+        return;
+    }
+    if (len > (int) sizeof(text) - 2) {
+        len = sizeof(text) - 2;
+    }
+    if (len == 0 || text[len - 1] != '\n') {
+        text[len++] = '\n';
+        text[len] = '\0';
+    }
+    log_enqueue(text);
+    return;
+}
+
+/*
+ * Emit one access-log line for a completed request
+ *
+ * method: request method
+ * uri: requested uri
+ * status: response status code, or -1 if no response was obtained
+ * bytes: response bytes written to the client
+ * hit: nonzero if the response came from the cache
+ * usecs: time from request line to response completion
+ */
+void log_access(const char *method, const char *uri, int status,
+                ssize_t bytes, int hit, long usecs) {
+    log_printf("access: %s %s %d %zd %s %ldus",
+               method, uri, status, bytes, hit ? "hit" : "miss", usecs);
+    return;
+}
+
+/*
+ * Stop the logger thread after it drains what is in the ring
+ */
+void release_log() {
+    __atomic_store_n(&logger_run, 0, __ATOMIC_RELEASE);
+    pthread_join(logger_tid, NULL);
+    return;
+}
@@ -0,0 +1,13 @@
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <sys/types.h>
+
+void init_log();
+void log_printf(const char *fmt, ...);
+void log_access(const char *method, const char *uri, int status,
+                ssize_t bytes, int hit, long usecs);
+void release_log();
+
+#endif
@@ -0,0 +1,295 @@
+#!/usr/bin/env python3
+
+############################################################################
+#  Proxylab testing framework
+#  Load-generation benchmark mode
+############################################################################
+
+# Open-loop load generator for benchmarking a proxy. Where pxydrive.py
+# checks correctness and reports pass/fail, this tool sustains a
+# configurable request rate and concurrency against the proxy and
+# reports throughput, p50/p99/p999 latency and error rate. It runs its
+# own threaded origin server, so the cache-hit mix and object-size
+# distribution are coordinated with the requests: a configurable
+# fraction of requests draws from a small hot set (cache hits after
+# first touch), the rest are unique urls (guaranteed misses), and
+# object sizes are sampled from a weighted distribution.
+#
+# Open loop means arrival times are fixed by the rate, not by
+# completions: latency is measured from the scheduled arrival, so
+# queueing delay inside an overloaded proxy shows up in the tail
+# instead of silently throttling the generator.
+
+import sys
+import os
+import socket
+import getopt
+import time
+import subprocess
+import threading
+import queue
+import random
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+def usage(name):
+    print("Usage: %s ([-p PROXY]|[-P HOST:PORT]) [-r RATE] [-c CONC]"
+          " [-D SECS] [-m HITMIX] [-s SIZES] [-H HOTSET]" % name)
+    print("  -h           Print this message")
+    print("  -p PROXY     Run specified proxy binary")
+    print("  -P HOST:PORT Use proxy running on specified host and port")
+    print("  -r RATE      Request rate in req/s (default 500)")
+    print("  -c CONC      Concurrent client connections (default 32)")
+    print("  -D SECS      Benchmark duration in seconds (default 10)")
+    print("  -m HITMIX    Fraction of requests to the hot set (default 0.8)")
+    print("  -s SIZES     Object size distribution as size:weight pairs,")
+    print("               e.g. 1024:0.9,102400:0.1 (default)")
+    print("  -H HOTSET    Number of distinct hot urls (default 64)")
+    sys.exit(0)
+
+
+# Origin: serves /obj-SIZE-ID with SIZE bytes of deterministic payload
+class OriginHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_GET(self):
+        try:
+            size = int(self.path.split("-")[1])
+        except (IndexError, ValueError):
+            self.send_error(404)
+            return
+        body = b"a" * size
+        self.send_response(200)
+        self.send_header("Content-Length", str(size))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, fmt, *args):
+        pass
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def wait_for_port(host, port, timeout=5.0):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        try:
+            s = socket.create_connection((host, port), 0.25)
+            s.close()
+            return True
+        except OSError:
+            time.sleep(0.05)
+    return False
+
+
+def parse_sizes(spec):
+    sizes = []
+    weights = []
+    for pair in spec.split(","):
+        size, weight = pair.split(":")
+        sizes.append(int(size))
+        weights.append(float(weight))
+    return sizes, weights
+
+
+# One benchmark client: holds a persistent connection to the proxy and
+# issues the requests it is handed, recording latency from the
+# scheduled arrival time
+class Worker(threading.Thread):
+    def __init__(self, proxy_host, proxy_port, work):
+        threading.Thread.__init__(self)
+        self.proxy_host = proxy_host
+        self.proxy_port = proxy_port
+        self.work = work
+        self.latencies = []
+        self.errors = 0
+        self.sock = None
+        self.rfile = None
+
+    def connect(self):
+        self.sock = socket.create_connection(
+            (self.proxy_host, self.proxy_port), 5.0)
+        self.sock.settimeout(10.0)
+        self.rfile = self.sock.makefile("rb")
+
+    def close(self):
+        if self.rfile is not None:
+            self.rfile.close()
+            self.rfile = None
+        if self.sock is not None:
+            self.sock.close()
+            self.sock = None
+
+    def fetch(self, url, size):
+        if self.sock is None:
+            self.connect()
+        req = "GET %s HTTP/1.1\r\nHost: bench\r\n\r\n" % url
+        self.sock.sendall(req.encode())
+        line = self.rfile.readline()
+        if not line.startswith(b"HTTP/") or b" 200 " not in line:
+            raise OSError("bad status: %r" % line)
+        clen = -1
+        while True:
+            hdr = self.rfile.readline()
+            if hdr in (b"\r\n", b""):
+                break
+            if hdr.lower().startswith(b"content-length:"):
+                clen = int(hdr.split(b":")[1])
+        if clen != size:
+            raise OSError("bad length %d != %d" % (clen, size))
+        remaining = clen
+        while remaining > 0:
+            chunk = self.rfile.read(min(remaining, 65536))
+            if not chunk:
+                raise OSError("truncated body")
+            remaining -= len(chunk)
+
+    def run(self):
+        while True:
+            item = self.work.get()
+            if item is None:
+                break
+            sched, url, size = item
+            try:
+                self.fetch(url, size)
+                self.latencies.append(time.time() - sched)
+            except OSError:
+                self.errors += 1
+                self.close()
+
+
+def percentile(values, frac):
+    if not values:
+        return 0.0
+    idx = min(int(len(values) * frac), len(values) - 1)
+    return values[idx]
+
+
+def run(name, args):
+    proxy_bin = None
+    proxy_host = None
+    proxy_port = None
+    rate = 500.0
+    conc = 32
+    duration = 10.0
+    hitmix = 0.8
+    hotset = 64
+    size_spec = "1024:0.9,102400:0.1"
+
+    optlist, _ = getopt.getopt(args, "hp:P:r:c:D:m:s:H:")
+    for (opt, val) in optlist:
+        if opt == "-h":
+            usage(name)
+        elif opt == "-p":
+            proxy_bin = val
+        elif opt == "-P":
+            proxy_host, port = val.split(":")
+            proxy_port = int(port)
+        elif opt == "-r":
+            rate = float(val)
+        elif opt == "-c":
+            conc = int(val)
+        elif opt == "-D":
+            duration = float(val)
+        elif opt == "-m":
+            hitmix = float(val)
+        elif opt == "-s":
+            size_spec = val
+        elif opt == "-H":
+            hotset = int(val)
+
+    if proxy_bin is None and proxy_host is None:
+        print("Must give either -p or -P")
+        usage(name)
+
+    sizes, weights = parse_sizes(size_spec)
+
+    # Start the coordinated origin
+    origin_port = free_port()
+    origin = ThreadingHTTPServer(("127.0.0.1", origin_port), OriginHandler)
+    threading.Thread(target=origin.serve_forever, daemon=True).start()
+
+    # Start the proxy if asked to
+    proxy_proc = None
+    if proxy_bin is not None:
+        proxy_host = "127.0.0.1"
+        proxy_port = free_port()
+        proxy_proc = subprocess.Popen([proxy_bin, str(proxy_port)],
+                                      stderr=subprocess.DEVNULL)
+        if not wait_for_port(proxy_host, proxy_port):
+            print("Proxy did not start listening")
+            proxy_proc.kill()
+            sys.exit(1)
+
+    # Pre-assign each hot url a size so repeat requests match
+    rng = random.Random(42)
+    hot_urls = []
+    for i in range(hotset):
+        size = rng.choices(sizes, weights)[0]
+        hot_urls.append(("http://127.0.0.1:%d/obj-%d-hot%d"
+                         % (origin_port, size, i), size))
+
+    work = queue.Queue()
+    workers = [Worker(proxy_host, proxy_port, work) for _ in range(conc)]
+    for w in workers:
+        w.start()
+
+    # Open-loop generation: arrivals are scheduled on a fixed cadence
+    # regardless of completions
+    interval = 1.0 / rate
+    start = time.time()
+    sched = start
+    issued = 0
+    unique = 0
+    while sched < start + duration:
+        now = time.time()
+        if sched > now:
+            time.sleep(sched - now)
+        if rng.random() < hitmix:
+            url, size = hot_urls[rng.randrange(hotset)]
+        else:
+            size = rng.choices(sizes, weights)[0]
+            url = ("http://127.0.0.1:%d/obj-%d-u%d"
+                   % (origin_port, size, unique))
+            unique += 1
+        work.put((sched, url, size))
+        issued += 1
+        sched += interval
+
+    for _ in workers:
+        work.put(None)
+    for w in workers:
+        w.join()
+    elapsed = time.time() - start
+
+    if proxy_proc is not None:
+        proxy_proc.terminate()
+        proxy_proc.wait()
+    origin.shutdown()
+
+    lats = []
+    errors = 0
+    for w in workers:
+        lats.extend(w.latencies)
+        errors += w.errors
+    lats.sort()
+
+    done = len(lats)
+    print("requests:   %d issued, %d completed, %d errors (%.2f%%)"
+          % (issued, done, errors,
+             100.0 * errors / issued if issued else 0.0))
+    print("throughput: %.1f req/s (target %.1f)" % (done / elapsed, rate))
+    print("latency ms: p50 %.2f  p99 %.2f  p999 %.2f"
+          % (percentile(lats, 0.50) * 1000.0,
+             percentile(lats, 0.99) * 1000.0,
+             percentile(lats, 0.999) * 1000.0))
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
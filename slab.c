@@ -0,0 +1,257 @@
+
+/*
+ * Andrew Id: enhanc
+ * slab.c recycles the two kinds of memory the cache churns through:
+ * entry structs and object data buffers. Entry structs come from slabs
+ * of 64 allocated at a time and recycle through a free list, so an
+ * insert/evict cycle reuses a struct instead of round-tripping through
+ * malloc/free. Object buffers are pooled in power-of-two size classes;
+ * each buffer carries a small hidden header recording its class, so it
+ * can change owners (the response accumulator hands buffers to the
+ * cache) and still land back in the right pool when freed. Buffers
+ * larger than the biggest class fall through to plain malloc/free. A
+ * single mutex guards both pools; pool operations are a few pointer
+ * moves, far cheaper than the allocator work they replace.
+ */
+
+#include "csapp.h"
+#include "slab.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cache.h"
+
+// Entry structs carved out per malloc
+#define ENTRIES_PER_SLAB 64
+
+// Smallest buffer class is 1<<BUF_MIN_SHIFT bytes (4KB)
+#define BUF_MIN_SHIFT 12
+
+// Number of size classes (4KB up to 128MB)
+#define BUF_NCLASSES 16
+
+// Free buffers kept per class before excess is returned to malloc
+#define BUF_POOL_PER_CLASS 32
+
+// Class value marking a buffer that lives inside a read-only mapping
+// (the cache snapshot); freeing such a buffer is a no-op since the
+// mapping owns the memory
+#define BUF_CLS_MAPPED (-2)
+
+/*
+ * Hidden header in front of every pooled buffer. Records the size
+ * class (-1 when the buffer came straight from malloc, -2 when the
+ * buffer lives inside a mapped snapshot) and links free buffers of the
+ * same class; padded to keep the payload aligned.
+ */
+typedef struct bufhdr {
+    struct bufhdr *next;    /* next free buffer in this class */
+    long cls;               /* size class, -1 malloc, -2 mapped */
+} bufhdr_t;
+
+/*
+ * A free cache entry struct; overlays the entry memory while free
+ */
+typedef struct free_entry {
+    struct free_entry *next;
+} free_entry_t;
+
+/*
+ * One malloc'd slab of entry structs, kept so release_slab can free it
+ */
+typedef struct slab_block {
+    struct slab_block *next;
+    char entries[ENTRIES_PER_SLAB * sizeof(Cache)];
+} slab_block_t;
+
+static slab_block_t *slab_blocks;
+static free_entry_t *entry_freelist;
+static bufhdr_t *buf_freelists[BUF_NCLASSES];
+static int buf_freecounts[BUF_NCLASSES];
+static pthread_mutex_t slab_mutex;
+
+/*
+ * Initialize the pools
+ */
+void init_slab() {
+    slab_blocks = NULL;
+    entry_freelist = NULL;
+    for (int i = 0; i < BUF_NCLASSES; i++) {
+        buf_freelists[i] = NULL;
+        buf_freecounts[i] = 0;
+    }
+    pthread_mutex_init(&slab_mutex, NULL);
+    return;
+}
+
+/*
+ * Take a cache entry struct from the slab pool, carving a fresh slab
+ * when the free list is empty
+ */
+void *slab_entry_alloc() {
+    void *entry;
+
+    pthread_mutex_lock(&slab_mutex);
+    if (entry_freelist == NULL) {
+        slab_block_t *block = (slab_block_t *) malloc(sizeof(slab_block_t));
+        block->next = slab_blocks;
+        slab_blocks = block;
+
+        // Thread the new slab's structs onto the free list
+        for (int i = 0; i < ENTRIES_PER_SLAB; i++) {
+            free_entry_t *fe =
+                (free_entry_t *) (block->entries + i * sizeof(Cache));
+            fe->next = entry_freelist;
+            entry_freelist = fe;
+        }
+    }
+    entry = entry_freelist;
+    entry_freelist = entry_freelist->next;
+    pthread_mutex_unlock(&slab_mutex);
+    return entry;
+}
+
+/*
+ * Return a cache entry struct to the pool
+ */
+void slab_entry_free(void *entry) {
+    free_entry_t *fe = (free_entry_t *) entry;
+
+    pthread_mutex_lock(&slab_mutex);
+    fe->next = entry_freelist;
+    entry_freelist = fe;
+    pthread_mutex_unlock(&slab_mutex);
+    return;
+}
+
+/*
+ * Smallest size class that holds size bytes, or -1 if size exceeds the
+ * largest class
+ */
+static int buf_class_for(ssize_t size) {
+    for (int cls = 0; cls < BUF_NCLASSES; cls++) {
+        if (size <= ((ssize_t) 1 << (BUF_MIN_SHIFT + cls))) {
+            return cls;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Allocate a data buffer of at least size bytes, reusing a pooled
+ * buffer of the matching class when one is free
+ *
+ * size: bytes the caller needs
+ */
+char *slab_buf_alloc(ssize_t size) {
+    int cls = buf_class_for(size);
+    bufhdr_t *hdr = NULL;
+
+    if (cls >= 0) {
+        pthread_mutex_lock(&slab_mutex);
+        if (buf_freelists[cls] != NULL) {
+            hdr = buf_freelists[cls];
+            buf_freelists[cls] = hdr->next;
+            buf_freecounts[cls]--;
+        }
+        pthread_mutex_unlock(&slab_mutex);
+    }
+
+    if (hdr == NULL) {
+        ssize_t bytes = cls >= 0 ? ((ssize_t) 1 << (BUF_MIN_SHIFT + cls))
+                                 : size;
+        hdr = (bufhdr_t *) malloc(sizeof(bufhdr_t) + bytes);
+        hdr->cls = cls;
+    }
+    hdr->next = NULL;
+    return (char *) (hdr + 1);
+}
+
+/*
+ * Give a data buffer back to its class pool (or to malloc when the
+ * pool for that class is full or the buffer was oversized)
+ *
+ * buf: buffer returned by slab_buf_alloc
+ */
+void slab_buf_free(char *buf) {
+    bufhdr_t *hdr;
+
+    if (buf == NULL) {
+        return;
+    }
+    hdr = ((bufhdr_t *) buf) - 1;
+
+    // Snapshot-mapped buffers are owned by the mapping, not the pools
+    if (hdr->cls == BUF_CLS_MAPPED) {
+        return;
+    }
+
+    if (hdr->cls >= 0) {
+        pthread_mutex_lock(&slab_mutex);
+        if (buf_freecounts[hdr->cls] < BUF_POOL_PER_CLASS) {
+            hdr->next = buf_freelists[hdr->cls];
+            buf_freelists[hdr->cls] = hdr;
+            buf_freecounts[hdr->cls]++;
+            pthread_mutex_unlock(&slab_mutex);
+            return;
+        }
+        pthread_mutex_unlock(&slab_mutex);
+    }
+    free(hdr);
+    return;
+}
+
+/*
+ * Size of the hidden buffer header, for code that lays buffers out in
+ * a snapshot file
+ */
+ssize_t slab_buf_hdr_size() {
+    return sizeof(bufhdr_t);
+}
+
+/*
+ * Write a header marking the bytes that follow it as a mapped buffer,
+ * so a pointer just past it can be handed to slab_buf_free safely.
+ * Used by the cache snapshot writer so objects loaded from a mapping
+ * flow through the same ownership paths as pooled buffers.
+ *
+ * dst: slab_buf_hdr_size() bytes to fill
+ */
+void slab_buf_stamp_mapped(char *dst) {
+    bufhdr_t hdr;
+
+    hdr.next = NULL;
+    hdr.cls = BUF_CLS_MAPPED;
+    memcpy(dst, &hdr, sizeof(hdr));
+    return;
+}
+
+/*
+ * Free every slab and pooled buffer
+ */
+void release_slab() {
+    slab_block_t *block = slab_blocks;
+    while (block) {
+        slab_block_t *tmp = block->next;
+        free(block);
+        block = tmp;
+    }
+    slab_blocks = NULL;
+    entry_freelist = NULL;
+
+    for (int i = 0; i < BUF_NCLASSES; i++) {
+        bufhdr_t *hdr = buf_freelists[i];
+        while (hdr) {
+            bufhdr_t *tmp = hdr->next;
+            free(hdr);
+            hdr = tmp;
+        }
+        buf_freelists[i] = NULL;
+        buf_freecounts[i] = 0;
+    }
+    pthread_mutex_destroy(&slab_mutex);
+    return;
+}
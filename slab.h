@@ -0,0 +1,16 @@
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <sys/types.h>
+
+void init_slab();
+void *slab_entry_alloc();
+void slab_entry_free(void *entry);
+char *slab_buf_alloc(ssize_t size);
+void slab_buf_free(char *buf);
+ssize_t slab_buf_hdr_size();
+void slab_buf_stamp_mapped(char *dst);
+void release_slab();
+
+#endif
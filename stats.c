@@ -0,0 +1,135 @@
+
+/*
+ * Andrew Id: enhanc
+ * stats.c keeps running counters of what the proxy is doing so hit
+ * ratio, eviction rate and latency can be read off a live process
+ * instead of guessed at. Counters are plain longs bumped with gcc's
+ * atomic builtins, so the hot paths pay one uncontended atomic add and
+ * never take a lock. Request latency is recorded into two power-of-two
+ * bucketed histograms in microseconds, one for requests served from the
+ * cache and one for requests that went to the origin, so the two
+ * distributions can be compared directly. stats_render formats
+ * everything as plain text for the /proxy-stats endpoint.
+ */
+
+#include "stats.h"
+
+#include <stdio.h>
+#include <sys/time.h>
+
+// Histogram bucket i counts latencies in [2^i, 2^(i+1)) microseconds;
+// 24 buckets reach past 8 seconds, beyond any configured I/O timeout
+#define LAT_BUCKETS 24
+
+static long hits;
+static long misses;
+static long evictions;
+static long bytes_served;
+static long hit_latency[LAT_BUCKETS];
+static long miss_latency[LAT_BUCKETS];
+
+/*
+ * Reset every counter
+ */
+void init_stats() {
+    __atomic_store_n(&hits, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&misses, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&evictions, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&bytes_served, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        __atomic_store_n(&hit_latency[i], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&miss_latency[i], 0, __ATOMIC_RELAXED);
+    }
+    return;
+}
+
+void stats_count_hit() {
+    __atomic_fetch_add(&hits, 1, __ATOMIC_RELAXED);
+    return;
+}
+
+void stats_count_miss() {
+    __atomic_fetch_add(&misses, 1, __ATOMIC_RELAXED);
+    return;
+}
+
+void stats_count_eviction() {
+    __atomic_fetch_add(&evictions, 1, __ATOMIC_RELAXED);
+    return;
+}
+
+/*
+ * Add bytes written to a client, from either the cache or a relay
+ *
+ * bytes: number of bytes written
+ */
+void stats_count_bytes(ssize_t bytes) {
+    if (bytes > 0) {
+        __atomic_fetch_add(&bytes_served, bytes, __ATOMIC_RELAXED);
+    }
+    return;
+}
+
+/*
+ * Current wall-clock time in microseconds, for latency measurement
+ */
+long stats_now_usecs() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * Record one request's latency into the hit or miss histogram
+ *
+ * hit: nonzero if the request was served from the cache
+ * usecs: time from reading the request line to finishing the response
+ */
+void stats_record_latency(int hit, long usecs) {
+    int b = 0;
+    while (b < LAT_BUCKETS - 1 && usecs >= (1L << (b + 1))) {
+        b++;
+    }
+    __atomic_fetch_add(hit ? &hit_latency[b] : &miss_latency[b], 1,
+                       __ATOMIC_RELAXED);
+    return;
+}
+
+/*
+ * Format every counter as plain text. Histogram buckets with no samples
+ * are skipped so the report stays short. Returns the number of bytes
+ * written.
+ *
+ * buf: destination for the report
+ * cap: size of buf
+ */
+ssize_t stats_render(char *buf, size_t cap) {
+    size_t len = 0;
+    long h = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+    long m = __atomic_load_n(&misses, __ATOMIC_RELAXED);
+
+    len += snprintf(buf + len, cap - len, "hits: %ld\n", h);
+    len += snprintf(buf + len, cap - len, "misses: %ld\n", m);
+    len += snprintf(buf + len, cap - len, "hit_ratio: %.3f\n",
+                    h + m > 0 ? (double) h / (h + m) : 0.0);
+    len += snprintf(buf + len, cap - len, "evictions: %ld\n",
+                    __atomic_load_n(&evictions, __ATOMIC_RELAXED));
+    len += snprintf(buf + len, cap - len, "bytes_served: %ld\n",
+                    __atomic_load_n(&bytes_served, __ATOMIC_RELAXED));
+
+    for (int i = 0; i < LAT_BUCKETS && len < cap; i++) {
+        long c = __atomic_load_n(&hit_latency[i], __ATOMIC_RELAXED);
+        if (c > 0) {
+            len += snprintf(buf + len, cap - len,
+                            "hit_latency_us_lt_%ld: %ld\n", 1L << (i + 1), c);
+        }
+    }
+    for (int i = 0; i < LAT_BUCKETS && len < cap; i++) {
+        long c = __atomic_load_n(&miss_latency[i], __ATOMIC_RELAXED);
+        if (c > 0) {
+            len += snprintf(buf + len, cap - len,
+                            "miss_latency_us_lt_%ld: %ld\n", 1L << (i + 1), c);
+        }
+    }
+    return len < cap ? (ssize_t) len : (ssize_t) (cap - 1);
+}
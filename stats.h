@@ -0,0 +1,16 @@
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <sys/types.h>
+
+void init_stats();
+void stats_count_hit();
+void stats_count_miss();
+void stats_count_eviction();
+void stats_count_bytes(ssize_t bytes);
+long stats_now_usecs();
+void stats_record_latency(int hit, long usecs);
+ssize_t stats_render(char *buf, size_t cap);
+
+#endif
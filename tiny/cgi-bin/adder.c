@@ -24,11 +24,12 @@ int main(void) {
     }
 
     /* Make the response body */
-    sprintf(content, "Welcome to add.com: ");
-    sprintf(content, "%sTHE Internet addition portal.\r\n<p>", content);
-    sprintf(content, "%sThe answer is: %d + %d = %d\r\n<p>",
-            content, n1, n2, n1 + n2);
-    sprintf(content, "%sThanks for visiting!\r\n", content);
+    snprintf(content, MAXLINE,
+            "Welcome to add.com: "
+            "THE Internet addition portal.\r\n<p>"
+            "The answer is: %d + %d = %d\r\n<p>"
+            "Thanks for visiting!\r\n",
+            n1, n2, n1 + n2);
 
     /* Generate the HTTP response */
     printf("Connection: close\r\n");
@@ -1,6 +1,9 @@
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the
- *     GET method to serve static and dynamic content.
+ * tiny.c - A simple, concurrent HTTP/1.0 Web server that uses the
+ *     GET method to serve static and dynamic content. A fixed pool of
+ *     worker threads pulls accepted connections off a bounded queue,
+ *     and static files are sent with sendfile(2) so the kernel copies
+ *     file pages straight to the socket.
  *
  * Updated 04/2017 - Stanley Zhang <szz@andrew.cmu.edu>
  * Fixed some style issues, stop using csapp functions where not appropriate
@@ -15,8 +18,10 @@
 #include <unistd.h>
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
@@ -25,6 +30,12 @@
 #define HOSTLEN 256
 #define SERVLEN 8
 
+/* Worker threads serving connections */
+#define NTHREADS 16
+
+/* Accepted connections waiting for a worker */
+#define QUEUE_SLOTS 64
+
 /* Typedef for convenience */
 typedef struct sockaddr SA;
 
@@ -44,6 +55,59 @@ typedef enum {
     PARSE_DYNAMIC
 } parse_result;
 
+/*
+ * Bounded producer/consumer queue of accepted clients. The accept loop
+ * pushes, worker threads pop. When the queue is full the new connection
+ * is dropped so a burst sheds load instead of growing without bound.
+ */
+typedef struct {
+    client_info slots[QUEUE_SLOTS]; // circular buffer of clients
+    int count;                      // clients currently queued
+    int head;                       // next slot to pop
+    int tail;                       // next slot to push
+    pthread_mutex_t mutex;          // protects all queue fields
+    pthread_cond_t nonempty;        // signaled when a client is pushed
+} client_queue;
+
+static client_queue conn_queue = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .nonempty = PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * Push an accepted client onto the queue. Returns false on success, or
+ * true if the queue is full (caller should close the fd to shed the
+ * connection).
+ */
+bool client_queue_push(client_queue *q, client_info *client) {
+    pthread_mutex_lock(&q->mutex);
+    if (q->count == QUEUE_SLOTS) {
+        pthread_mutex_unlock(&q->mutex);
+        return true;
+    }
+    q->slots[q->tail] = *client;
+    q->tail = (q->tail + 1) % QUEUE_SLOTS;
+    q->count++;
+    pthread_cond_signal(&q->nonempty);
+    pthread_mutex_unlock(&q->mutex);
+    return false;
+}
+
+/*
+ * Pop a client off the queue into *client, blocking until one is
+ * available.
+ */
+void client_queue_pop(client_queue *q, client_info *client) {
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == 0) {
+        pthread_cond_wait(&q->nonempty, &q->mutex);
+    }
+    *client = q->slots[q->head];
+    q->head = (q->head + 1) % QUEUE_SLOTS;
+    q->count--;
+    pthread_mutex_unlock(&q->mutex);
+}
+
 /*
  * read_requesthdrs - read HTTP request headers
  * Returns true if an error occurred, or false otherwise.
@@ -137,10 +201,15 @@ void get_filetype(char *filename, char *filetype) {
 
 /*
  * serve_static - copy a file back to the client
+ *
+ * The body is sent with sendfile(2), which copies file pages to the
+ * socket inside the kernel. Unlike the old mmap+rio_writen path there
+ * is no user-space copy and no page table churn per request, so large
+ * files go out at close to link speed.
  */
 void serve_static(int fd, char *filename, int filesize) {
     int srcfd;
-    char *srcp;
+    off_t off = 0;
     char filetype[MAXLINE];
     char buf[MAXBUF];
     size_t buflen;
@@ -174,24 +243,15 @@ void serve_static(int fd, char *filename, int filesize) {
         return;
     }
 
-    srcp = mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    if (srcp == MAP_FAILED) {
-        perror("mmap");
-        close(srcfd);
-        return;
-    }
-    close(srcfd);
-
-    if (rio_writen(fd, srcp, filesize) < 0) {
-        fprintf(stderr, "Error writing static file \"%s\" to client\n",
-                filename);
-        // Fall through to cleanup
+    while (off < filesize) {
+        if (sendfile(fd, srcfd, &off, filesize - off) < 0) {
+            fprintf(stderr, "Error writing static file \"%s\" to client\n",
+                    filename);
+            break;
+        }
     }
 
-    if (munmap(srcp, filesize) < 0) {
-        perror("munmap");
-        return;
-    }
+    close(srcfd);
 }
 
 /*
@@ -236,9 +296,10 @@ void serve_dynamic(int fd, char *filename, char *cgiargs) {
         return;
     }
 
-    /* Parent waits for and reaps child */
-    if (wait(NULL) < 0) {
-        perror("wait");
+    /* Parent waits for and reaps its own child; with concurrent
+     * workers forking, wait(NULL) could reap another thread's child */
+    if (waitpid(pid, NULL, 0) < 0) {
+        perror("waitpid");
         return;
     }
 }
@@ -380,8 +441,25 @@ void serve(client_info *client) {
     }
 }
 
+/*
+ * worker_thread - pull accepted clients off the queue and serve them
+ */
+void *worker_thread(void *vargp) {
+    (void) vargp;
+    pthread_detach(pthread_self());
+
+    while (1) {
+        client_info client;
+        client_queue_pop(&conn_queue, &client);
+        serve(&client);
+        close(client.connfd);
+    }
+    return NULL;
+}
+
 int main(int argc, char **argv) {
     int listenfd;
+    pthread_t tid;
 
     /* Check command line args */
     if (argc != 2) {
@@ -389,12 +467,21 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    /* A client that hangs up mid-response must not kill the server;
+     * the failed write surfaces as an error return instead */
+    signal(SIGPIPE, SIG_IGN);
+
     listenfd = open_listenfd(argv[1]);
     if (listenfd < 0) {
         fprintf(stderr, "Failed to listen on port: %s\n", argv[1]);
         exit(1);
     }
 
+    /* Spawn the fixed pool of worker threads */
+    for (int i = 0; i < NTHREADS; i++) {
+        pthread_create(&tid, NULL, worker_thread, NULL);
+    }
+
     while (1) {
         /* Allocate space on the stack for client info */
         client_info client_data;
@@ -411,9 +498,10 @@ int main(int argc, char **argv) {
             continue;
         }
 
-        /* Connection is established; serve client */
-        serve(client);
-        close(client->connfd);
+        /* Connection is established; hand it to a worker */
+        if (client_queue_push(&conn_queue, client)) {
+            close(client->connfd);
+        }
     }
 }
 
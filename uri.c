@@ -0,0 +1,101 @@
+
+/*
+ * Andrew Id: enhanc
+ * uri.c parses request uris into views: pointers and lengths into the
+ * caller's buffer, instead of copies. The old parser strcpy'd hostname,
+ * port and path into three separate MAXLINE stack buffers per request
+ * (24KB of stack traffic for strings averaging under 100 bytes) and
+ * left the path unterminated when the uri had none; the view parser
+ * walks the uri once, allocates and copies nothing, and substitutes
+ * static defaults for a missing port or path. Only the dial path, where
+ * getaddrinfo insists on NUL-terminated strings, ever materializes the
+ * host and port, into two small buffers via uri_host_port_cstr.
+ */
+
+#include "uri.h"
+
+#include <string.h>
+
+/*
+ * Parse an uri into host, port and path views. Accepts both absolute
+ * form ("http://host:port/path") and the bare "host:port/path" some
+ * clients send to a proxy; port defaults to "80" and path to "/".
+ * Nothing is copied or modified. Returns 0 on success, -1 when no
+ * hostname can be found.
+ *
+ * uri: uri from the request line; must outlive the view
+ * view: receives the parsed views
+ */
+int parse_uri(const char *uri, uri_view_t *view) {
+    const char *p = uri;
+    const char *scheme = strstr(p, "//");
+
+    if (scheme != NULL) {
+        p = scheme + 2;
+    }
+
+    view->host = p;
+    while (*p != '\0' && *p != ':' && *p != '/') {
+        p++;
+    }
+    view->host_len = p - view->host;
+    if (view->host_len == 0) {
+        return -1;
+    }
+
+    if (*p == ':') {
+        p++;
+        view->port = p;
+        while (*p != '\0' && *p != '/') {
+            p++;
+        }
+        view->port_len = p - view->port;
+        if (view->port_len == 0) {
+            return -1;
+        }
+    } else {
+        view->port = "80";
+        view->port_len = 2;
+    }
+
+    if (*p == '/') {
+        view->path = p;
+        view->path_len = strlen(p);
+    } else {
+        view->path = "/";
+        view->path_len = 1;
+    }
+    return 0;
+}
+
+/*
+ * Whether the uri names the default HTTP port, so the Host header can
+ * omit it
+ */
+int uri_default_port(const uri_view_t *view) {
+    return view->port_len == 2 && strncmp(view->port, "80", 2) == 0;
+}
+
+/*
+ * Materialize the host and port as NUL-terminated strings, for the
+ * socket calls that require them. Returns 0 on success, -1 when either
+ * does not fit its buffer.
+ *
+ * view: parsed uri views
+ * host: receives the hostname
+ * hostcap: size of host
+ * port: receives the port digits
+ * portcap: size of port
+ */
+int uri_host_port_cstr(const uri_view_t *view, char *host, size_t hostcap,
+                       char *port, size_t portcap) {
+    if ((size_t) view->host_len >= hostcap ||
+        (size_t) view->port_len >= portcap) {
+        return -1;
+    }
+    memcpy(host, view->host, view->host_len);
+    host[view->host_len] = '\0';
+    memcpy(port, view->port, view->port_len);
+    port[view->port_len] = '\0';
+    return 0;
+}
@@ -0,0 +1,26 @@
+
+#ifndef __URI_H__
+#define __URI_H__
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/*
+ * Views into a request uri; pointers reference either the caller's uri
+ * buffer or static defaults, never an allocation
+ */
+typedef struct {
+    const char *host;   /* hostname */
+    ssize_t host_len;
+    const char *port;   /* port digits; "80" when the uri names none */
+    ssize_t port_len;
+    const char *path;   /* path including leading '/'; "/" when absent */
+    ssize_t path_len;
+} uri_view_t;
+
+int parse_uri(const char *uri, uri_view_t *view);
+int uri_default_port(const uri_view_t *view);
+int uri_host_port_cstr(const uri_view_t *view, char *host, size_t hostcap,
+                       char *port, size_t portcap);
+
+#endif